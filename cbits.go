@@ -6,9 +6,12 @@ package caffe2
 import "C"
 import (
 	"context"
+	"encoding/json"
 	"fmt"
 	"io/ioutil"
 	"path/filepath"
+	"sync"
+	"time"
 	"unsafe"
 
 	"github.com/rai-project/dlframework/framework/options"
@@ -26,15 +29,94 @@ const (
 	CUDADevice        = Device(C.CUDA_DEVICE_KIND)
 )
 
+// Priority decides which predictor runs are paused between operators so
+// that latency critical predictors can share cores with offline ones.
+type Priority int
+
+const (
+	// NormalPriority runs are neither paused nor pause other runs.
+	NormalPriority Priority = Priority(C.NORMAL_PRIORITY)
+	// LowPriority runs are paused while HighPriority runs are in progress.
+	LowPriority = Priority(C.LOW_PRIORITY)
+	// HighPriority runs pause the LowPriority runs of the process.
+	HighPriority = Priority(C.HIGH_PRIORITY)
+)
+
+// Clock is the clock the profiles are timed with.
+type Clock int
+
+const (
+	// SteadyClock is the monotonic clock of the C++ standard library.
+	SteadyClock Clock = Clock(C.STEADY_CLOCK)
+	// TSCClock reads the time stamp counter of the processor, which is
+	// cheaper and finer than SteadyClock. It is only available on x86
+	// processors with an invariant counter.
+	TSCClock = Clock(C.TSC_CLOCK)
+)
+
 type Predictor struct {
 	ctx     C.PredictorContext
 	options *options.Options
+	// registry is set when the predictor was acquired from a Registry, in
+	// which case Close releases it instead of deleting it
+	registry *Registry
+	modelID  string
+	// warmupLatencies are the latencies of the warmup runs made by
+	// NewWithOptions
+	warmupLatencies [][]time.Duration
+}
+
+// PredictorOptions are the caffe2 specific settings used when creating a
+// predictor.
+type PredictorOptions struct {
+	// DisableGraphOptimizations keeps the predict net as is instead of
+	// folding batch norms, fusing activations and removing no-op operators.
+	DisableGraphOptimizations bool
+	// InputMean and InputStd, when set, hold the per channel normalization
+	// `(x - mean) / std` that is folded into the weights of the first
+	// convolution. Inputs are then fed to Predict without normalization.
+	// InputStd defaults to ones.
+	InputMean []float32
+	InputStd  []float32
+	// NumThreads is the number of intra-op threads used by the caffe2 thread
+	// pool, OpenMP and the BLAS library while the predictor runs. Zero keeps
+	// the library defaults.
+	NumThreads int
+	// CPUs the predictor threads are pinned to while it runs.
+	CPUs []int
+	// BindNUMANode binds the predictor to NUMANode: its parameters and
+	// activations are allocated on the node and its threads are pinned to
+	// the node cpus (intersected with CPUs when both are set).
+	BindNUMANode bool
+	NUMANode     int
+	// HugePages backs the large parameter and activation tensors with
+	// pre-faulted 2MB pages, locked in memory when LockMemory is set.
+	HugePages  bool
+	LockMemory bool
+	// Priority of the predictor runs, NormalPriority by default.
+	Priority Priority
+	// Weight is the share of the executor workers the predictor gets
+	// relative to the other predictors of its priority. Zero counts as one.
+	Weight int
+	// WarmupShapes, when set, are warmed up by NewWithOptions with
+	// WarmupIterations runs each (one when zero) before it returns, see
+	// Warmup. The latencies are returned by WarmupLatencies.
+	WarmupShapes     []Shape
+	WarmupIterations int
 }
 
 func New(ctx context.Context, opts ...options.Option) (*Predictor, error) {
+	return NewWithOptions(ctx, PredictorOptions{}, opts...)
+}
+
+func NewWithOptions(ctx context.Context, predOpts PredictorOptions, opts ...options.Option) (*Predictor, error) {
 	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_new")
 	defer span.Finish()
 
+	if predOpts.WarmupIterations < 0 {
+		return nil, errors.New("warmup iterations must be positive")
+	}
+
 	options := options.New(opts...)
 	initNetFile := string(options.Weights())
 	if !com.IsFile(initNetFile) {
@@ -51,17 +133,21 @@ func New(ctx context.Context, opts ...options.Option) (*Predictor, error) {
 		}
 	}
 
-	device := C.DeviceKind(CPUDevice)
-	if options.UsesGPU() {
-		if !nvidiasmi.HasGPU {
-			return nil, errors.New("no GPU device")
-		}
-		device = C.DeviceKind(CUDADevice)
+	device, err := deviceKind(options)
+	if err != nil {
+		return nil, err
 	}
 
 	C.InitCaffe2(device)
 
+	cOpts, freeOpts, err := predOpts.toC()
+	if err != nil {
+		return nil, err
+	}
+	defer freeOpts()
+
 	var pred C.PredictorContext
+	var cErr *C.char
 	if isOnnxFormat {
 		bts, err := ioutil.ReadFile(initNetFile)
 		if err != nil {
@@ -76,6 +162,8 @@ func New(ctx context.Context, opts ...options.Option) (*Predictor, error) {
 			(*C.char)(cNetData),
 			C.int64_t(len(bts)),
 			device,
+			&cOpts,
+			&cErr,
 		)
 	} else {
 		cInitNetFile := C.CString(initNetFile)
@@ -88,17 +176,118 @@ func New(ctx context.Context, opts ...options.Option) (*Predictor, error) {
 			cInitNetFile,
 			cPredictNetFile,
 			device,
+			&cOpts,
+			&cErr,
 		)
 	}
 
 	if pred == nil {
-		log.Panicln("unable to create caffe2 predictor")
+		if cErr == nil {
+			return nil, errors.New("unable to create caffe2 predictor")
+		}
+		defer C.free(unsafe.Pointer(cErr))
+		return nil, errors.Errorf("unable to create caffe2 predictor: %s", C.GoString(cErr))
 	}
 
-	return &Predictor{
+	p := &Predictor{
 		ctx:     pred,
 		options: options,
-	}, nil
+	}
+
+	if len(predOpts.WarmupShapes) != 0 {
+		iterations := predOpts.WarmupIterations
+		if iterations == 0 {
+			iterations = 1
+		}
+		latencies, err := p.Warmup(ctx, iterations, predOpts.WarmupShapes...)
+		if err != nil {
+			p.Close()
+			return nil, err
+		}
+		p.warmupLatencies = latencies
+	}
+
+	return p, nil
+}
+
+func deviceKind(options *options.Options) (C.DeviceKind, error) {
+	if !options.UsesGPU() {
+		return C.DeviceKind(CPUDevice), nil
+	}
+	if !nvidiasmi.HasGPU {
+		return C.DeviceKind(CPUDevice), errors.New("no GPU device")
+	}
+	return C.DeviceKind(CUDADevice), nil
+}
+
+// toC converts the options to their C representation. The returned
+// function frees the C memory they reference.
+func (o PredictorOptions) toC() (C.PredictorOptions, func(), error) {
+	var cAllocs []unsafe.Pointer
+	free := func() {
+		for _, p := range cAllocs {
+			C.free(p)
+		}
+	}
+
+	cOpts := C.DefaultPredictorOptionsCaffe2()
+	if o.DisableGraphOptimizations {
+		cOpts.optimize_graph = 0
+	}
+	if len(o.InputMean) != 0 {
+		channels := len(o.InputMean)
+		if len(o.InputStd) != 0 && len(o.InputStd) != channels {
+			return cOpts, free, errors.New("input mean and std must have the same length")
+		}
+		cMean := C.malloc(C.size_t(channels) * C.sizeof_float)
+		cAllocs = append(cAllocs, cMean)
+		copy((*[1 << 30]float32)(cMean)[:channels:channels], o.InputMean)
+		cOpts.input_mean = (*C.float)(cMean)
+		cOpts.input_channels = C.int(channels)
+		if len(o.InputStd) != 0 {
+			cStd := C.malloc(C.size_t(channels) * C.sizeof_float)
+			cAllocs = append(cAllocs, cStd)
+			copy((*[1 << 30]float32)(cStd)[:channels:channels], o.InputStd)
+			cOpts.input_std = (*C.float)(cStd)
+		}
+	}
+
+	if o.NumThreads < 0 {
+		return cOpts, free, errors.New("the number of threads must be positive")
+	}
+	cOpts.num_threads = C.int(o.NumThreads)
+	if len(o.CPUs) != 0 {
+		numCPUs := len(o.CPUs)
+		cCPUs := C.malloc(C.size_t(numCPUs) * C.sizeof_int)
+		cAllocs = append(cAllocs, cCPUs)
+		cpus := (*[1 << 30]C.int)(cCPUs)[:numCPUs:numCPUs]
+		for ii, cpu := range o.CPUs {
+			cpus[ii] = C.int(cpu)
+		}
+		cOpts.cpus = (*C.int)(cCPUs)
+		cOpts.num_cpus = C.int(numCPUs)
+	}
+
+	if o.BindNUMANode {
+		if o.NUMANode < 0 {
+			return cOpts, free, errors.New("invalid numa node")
+		}
+		cOpts.numa_node = C.int(o.NUMANode)
+	}
+
+	if o.HugePages {
+		cOpts.huge_pages = 1
+	}
+	if o.LockMemory {
+		cOpts.lock_memory = 1
+	}
+	cOpts.priority = C.Priority(o.Priority)
+	if o.Weight < 0 {
+		return cOpts, free, errors.New("the executor weight must be positive")
+	}
+	cOpts.weight = C.int(o.Weight)
+
+	return cOpts, free, nil
 }
 
 func (p *Predictor) Predict(ctx context.Context, data []float32, channels int,
@@ -125,12 +314,253 @@ func (p *Predictor) Predict(ctx context.Context, data []float32, channels int,
 	inputType := C.CString("float")
 	defer C.free(unsafe.Pointer(inputType))
 
-	ok := C.PredictCaffe2(p.ctx, ptr, inputType, C.int(batchSize), C.int(channels), C.int(width), C.int(height))
+	if ctx.Done() == nil {
+		ok := C.PredictCaffe2(p.ctx, ptr, inputType, C.int(batchSize), C.int(channels), C.int(width), C.int(height))
+		if ok != 0 {
+			return errors.New("unable to perform caffe2 prediction")
+		}
+		return nil
+	}
+
+	return withContext(ctx, func(timeout C.int64_t, token C.CancelTokenContext) C.error_t {
+		return C.PredictWithDeadlineCaffe2(p.ctx, ptr, inputType, C.int(batchSize), C.int(channels), C.int(width), C.int(height),
+			timeout, token)
+	})
+}
+
+// PredictPartial runs the operators that outputBlob depends on, e.g. to
+// extract the embedding of an intermediate layer, and skips the rest of
+// the net. The value of outputBlob is then read with ReadPredictionOutput.
+func (p *Predictor) PredictPartial(ctx context.Context, outputBlob string, data []float32, channels int,
+	width int, height int) error {
+	batchSize := p.options.BatchSize()
+	if len(data) < batchSize*channels*width*height {
+		return errors.New("input data is smaller than the batch")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_predict_partial")
+	defer span.Finish()
+
+	cOutputBlob := C.CString(outputBlob)
+	defer C.free(unsafe.Pointer(cOutputBlob))
+
+	ok := C.PredictPartialCaffe2(p.ctx, (*C.float)(unsafe.Pointer(&data[0])), cOutputBlob,
+		C.int(batchSize), C.int(channels), C.int(width), C.int(height))
 	if ok != 0 {
+		return errors.Errorf("unable to compute caffe2 blob %s", outputBlob)
+	}
+	return nil
+}
+
+// withContext runs predict with the deadline of the context and a cancel
+// token that is cancelled when the context is done. The predictor checks
+// them between operators.
+func withContext(ctx context.Context, predict func(timeout C.int64_t, token C.CancelTokenContext) C.error_t) error {
+	var timeout time.Duration
+	if deadline, ok := ctx.Deadline(); ok {
+		timeout = time.Until(deadline)
+		if timeout <= 0 {
+			return context.DeadlineExceeded
+		}
+	}
+
+	token := C.NewCancelTokenCaffe2()
+	stop := make(chan struct{})
+	var wg sync.WaitGroup
+	wg.Add(1)
+	go func() {
+		defer wg.Done()
+		select {
+		case <-ctx.Done():
+			C.CancelCaffe2(token)
+		case <-stop:
+		}
+	}()
+
+	ok := predict(C.int64_t(timeout/time.Microsecond), token)
+
+	close(stop)
+	wg.Wait()
+	C.DeleteCancelTokenCaffe2(token)
+
+	switch ok {
+	case C.success:
+		return nil
+	case C.error_deadline_exceeded:
+		return context.DeadlineExceeded
+	case C.error_cancelled:
+		return context.Canceled
+	default:
 		return errors.New("unable to perform caffe2 prediction")
 	}
+}
 
-	return nil
+// PredictResult is the outcome of PredictFused.
+type PredictResult struct {
+	// Output holds the predictions, PredLen per input of the batch.
+	Output  []float32
+	PredLen int
+	// Profile is the JSON profile of the run when it was requested.
+	Profile string
+}
+
+// PredictFused runs a prediction and returns its output, and its profile
+// when profile is set, in a single call into caffe2. The output is written
+// to output when it is large enough, a new slice is allocated otherwise.
+// Unlike Predict, data is read in place and must hold a full batch.
+func (p *Predictor) PredictFused(ctx context.Context, data []float32, channels int,
+	width int, height int, output []float32, profile bool) (*PredictResult, error) {
+	batchSize := p.options.BatchSize()
+	if len(data) < batchSize*channels*width*height {
+		return nil, errors.New("input data is smaller than the batch")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_predict_fused")
+	defer span.Finish()
+
+	var cOutput *C.float
+	if len(output) != 0 {
+		cOutput = (*C.float)(unsafe.Pointer(&output[0]))
+	}
+	request := C.PredictRequest{
+		batch_size:      C.int(batchSize),
+		channels:        C.int(channels),
+		width:           C.int(width),
+		height:          C.int(height),
+		output_capacity: C.int64_t(len(output)),
+	}
+	if profile {
+		request.profile = 1
+	}
+	var response C.PredictResponse
+
+	predict := func(timeout C.int64_t, token C.CancelTokenContext) C.error_t {
+		request.timeout_us = timeout
+		request.token = token
+		return C.PredictFusedCaffe2(p.ctx, (*C.float)(unsafe.Pointer(&data[0])), cOutput, &request, &response)
+	}
+	var err error
+	if ctx.Done() == nil {
+		if predict(0, nil) != C.success {
+			err = errors.New("unable to perform caffe2 prediction")
+		}
+	} else {
+		err = withContext(ctx, predict)
+	}
+	if response.profile != nil {
+		defer C.free(unsafe.Pointer(response.profile))
+	}
+	if err != nil {
+		return nil, err
+	}
+
+	size := int(response.output_size)
+	result := &PredictResult{
+		PredLen: int(response.pred_len),
+		Profile: C.GoString(response.profile),
+	}
+	if response.output == nil {
+		result.Output = output[:size]
+	} else {
+		result.Output = make([]float32, size)
+		copy(result.Output, (*[1 << 30]float32)(unsafe.Pointer(response.output))[:size:size])
+	}
+	return result, nil
+}
+
+// Shape is the input shape of a prediction request.
+type Shape struct {
+	BatchSize int
+	Channels  int
+	Width     int
+	Height    int
+}
+
+// Warmup runs iterations predictions with synthetic inputs for each of the
+// shapes so that the first requests served by the predictor do not pay for
+// buffer allocation, page faults and engine initialization. The latency of
+// every run is returned indexed by shape and then by iteration, which can
+// be used to decide when the predictor has reached its steady state.
+func (p *Predictor) Warmup(ctx context.Context, iterations int, shapes ...Shape) ([][]time.Duration, error) {
+	if iterations < 1 {
+		return nil, errors.New("warmup iterations must be positive")
+	}
+	if len(shapes) == 0 {
+		return nil, errors.New("no warmup shapes specified")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_warmup")
+	defer span.Finish()
+
+	cShapes := make([]C.int, 0, 4*len(shapes))
+	for _, shape := range shapes {
+		cShapes = append(cShapes, C.int(shape.BatchSize), C.int(shape.Channels), C.int(shape.Width), C.int(shape.Height))
+	}
+	cLatencies := make([]C.double, iterations*len(shapes))
+
+	ok := C.WarmupCaffe2(p.ctx, C.int(iterations), &cShapes[0], C.int(len(shapes)), &cLatencies[0])
+	if ok != 0 {
+		return nil, errors.New("unable to warmup caffe2 predictor")
+	}
+
+	latencies := make([][]time.Duration, len(shapes))
+	for ii := range shapes {
+		latencies[ii] = make([]time.Duration, iterations)
+		for jj := 0; jj < iterations; jj++ {
+			ms := float64(cLatencies[ii*iterations+jj])
+			latencies[ii][jj] = time.Duration(ms * float64(time.Millisecond))
+		}
+	}
+
+	return latencies, nil
+}
+
+// WarmupLatencies returns the latencies of the warmup runs made when the
+// predictor was created with WarmupShapes, indexed as the ones returned by
+// Warmup.
+func (p *Predictor) WarmupLatencies() [][]time.Duration {
+	return p.warmupLatencies
+}
+
+// SwapWeights replaces the parameters of the predictor with the ones of
+// initNetFile without interrupting the predictions. The new parameters are
+// loaded, optimized and warmed up with iterations runs of each of the shapes
+// (none when no shapes are given) before subsequent predictions use them,
+// while the predictions in flight finish with the previous parameters.
+// The predictors a Registry reloaded from a spill cannot swap weights,
+// since their net was rewritten for the spilled ones.
+func (p *Predictor) SwapWeights(ctx context.Context, initNetFile string, iterations int, shapes ...Shape) error {
+	if !com.IsFile(initNetFile) {
+		return errors.Errorf("file %s not found", initNetFile)
+	}
+	if iterations < 0 {
+		return errors.New("warmup iterations must be positive")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_swap_weights")
+	defer span.Finish()
+
+	cInitNetFile := C.CString(initNetFile)
+	defer C.free(unsafe.Pointer(cInitNetFile))
+
+	var cShapes *C.int
+	if len(shapes) != 0 {
+		dims := make([]C.int, 0, 4*len(shapes))
+		for _, shape := range shapes {
+			dims = append(dims, C.int(shape.BatchSize), C.int(shape.Channels), C.int(shape.Width), C.int(shape.Height))
+		}
+		cShapes = &dims[0]
+	}
+
+	switch C.SwapWeightsCaffe2(p.ctx, cInitNetFile, C.int(iterations), cShapes, C.int(len(shapes)), nil) {
+	case C.success:
+		return nil
+	case C.error_invalid_argument:
+		// non-positive shapes, or a predictor loaded from a registry spill
+		return errors.Errorf("invalid swap of the caffe2 predictor weights with %s", initNetFile)
+	default:
+		return errors.Errorf("unable to swap the caffe2 predictor weights with %s", initNetFile)
+	}
 }
 
 func (p *Predictor) ReadPredictionOutput(ctx context.Context) ([]float32, error) {
@@ -149,6 +579,10 @@ func (p *Predictor) ReadPredictionOutput(ctx context.Context) ([]float32, error)
 }
 
 func (p *Predictor) Close() {
+	if p.registry != nil {
+		p.registry.release(p.modelID)
+		return
+	}
 	C.DeleteCaffe2(p.ctx)
 }
 
@@ -179,3 +613,366 @@ func (p *Predictor) ReadProfile() (string, error) {
 	defer C.free(unsafe.Pointer(cstr))
 	return C.GoString(cstr), nil
 }
+
+// StartHistograms aggregates the latency of every prediction, and of each
+// of its operators, into histograms until EndHistograms is called.
+func (p *Predictor) StartHistograms() {
+	C.StartHistogramsCaffe2(p.ctx)
+}
+
+func (p *Predictor) EndHistograms() {
+	C.EndHistogramsCaffe2(p.ctx)
+}
+
+// ResetHistograms empties the latency histograms.
+func (p *Predictor) ResetHistograms() {
+	C.ResetHistogramsCaffe2(p.ctx)
+}
+
+// HistogramBucket counts the durations in [Lower, Upper) nanoseconds.
+type HistogramBucket struct {
+	LowerNanoseconds uint64 `json:"lower_ns"`
+	UpperNanoseconds uint64 `json:"upper_ns"`
+	Count            uint64 `json:"count"`
+}
+
+// LatencyHistogram summarizes the durations of a net or an operator. The
+// percentiles are accurate to a quarter of their power of two.
+type LatencyHistogram struct {
+	Count           uint64            `json:"count"`
+	SumNanoseconds  uint64            `json:"sum_ns"`
+	MinNanoseconds  uint64            `json:"min_ns"`
+	MaxNanoseconds  uint64            `json:"max_ns"`
+	MeanNanoseconds float64           `json:"mean_ns"`
+	P50Nanoseconds  uint64            `json:"p50_ns"`
+	P90Nanoseconds  uint64            `json:"p90_ns"`
+	P99Nanoseconds  uint64            `json:"p99_ns"`
+	P999Nanoseconds uint64            `json:"p999_ns"`
+	Buckets         []HistogramBucket `json:"buckets"`
+}
+
+// OperatorHistogram is the latency histogram of an operator of the net.
+type OperatorHistogram struct {
+	LatencyHistogram
+	LayerSequenceIndex int    `json:"layer_sequence_index"`
+	Name               string `json:"name"`
+	Metadata           string `json:"metadata"`
+}
+
+// NetHistograms are the latency histograms of a net of the predictor: its
+// predict net, or a partial net (see PredictPartial) named after the blob it
+// stops at. The sessions of the predictor add to the ones of its net.
+type NetHistograms struct {
+	Name      string              `json:"name"`
+	Net       LatencyHistogram    `json:"net"`
+	Operators []OperatorHistogram `json:"ops"`
+}
+
+// Histograms are the latency histograms of a predictor, by net.
+type Histograms struct {
+	Enabled bool            `json:"enabled"`
+	Nets    []NetHistograms `json:"nets"`
+}
+
+// ReadHistograms returns the latency histograms of the predictor.
+func (p *Predictor) ReadHistograms() (*Histograms, error) {
+	cstr := C.ReadHistogramsCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil histograms")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	histograms := &Histograms{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), histograms); err != nil {
+		return nil, errors.Wrap(err, "failed to decode histograms")
+	}
+	return histograms, nil
+}
+
+// SetClock selects the clock of the profiles of the process. It must be
+// called while no profile is being recorded.
+func SetClock(clock Clock) error {
+	switch C.SetClockCaffe2(C.ClockKind(clock)) {
+	case C.success:
+		return nil
+	case C.error_not_implemented:
+		return errors.New("the clock is not available on this machine")
+	default:
+		return errors.New("failed to set the profile clock")
+	}
+}
+
+// ClockStats describes the clock of the profiles.
+type ClockStats struct {
+	Clock        string  `json:"clock"`
+	NsPerTick    float64 `json:"ns_per_tick"`
+	TSCAvailable bool    `json:"tsc_available"`
+}
+
+// ReadClock returns the clock the profiles are timed with.
+func ReadClock() (*ClockStats, error) {
+	cstr := C.ReadClockCaffe2()
+	if cstr == nil {
+		return nil, errors.New("failed to read nil clock statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := &ClockStats{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode clock statistics")
+	}
+	return stats, nil
+}
+
+// ReadProfileTrace returns the profile in the Chrome Trace Event format, to
+// be opened in chrome://tracing or Perfetto.
+func (p *Predictor) ReadProfileTrace() (string, error) {
+	cstr := C.ReadProfileTraceCaffe2(p.ctx)
+	if cstr == nil {
+		return "", errors.New("failed to read nil profile trace")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	return C.GoString(cstr), nil
+}
+
+// ReadOptimizationReport returns a JSON description of the graph rewrites
+// (no-op removal, batch norm folding, activation fusion) that were applied
+// to the predict net when the predictor was created.
+func (p *Predictor) ReadOptimizationReport() (string, error) {
+	cstr := C.ReadOptimizationReportCaffe2(p.ctx)
+	if cstr == nil {
+		return "", errors.New("failed to read nil optimization report")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	return C.GoString(cstr), nil
+}
+
+// ThreadingConfig is the effective intra-op threading configuration of a
+// predictor. Caffe2PoolThreads is zero when the size of the caffe2 thread
+// pool is left to the library default.
+type ThreadingConfig struct {
+	NumThreads        int   `json:"num_threads"`
+	CPUs              []int `json:"cpus"`
+	Caffe2PoolThreads int   `json:"caffe2_pool_threads"`
+	OpenMP            bool  `json:"openmp"`
+	OpenMPMaxThreads  int   `json:"openmp_max_threads"`
+	OpenBLAS          bool  `json:"openblas"`
+	OpenBLASThreads   int   `json:"openblas_threads"`
+	MKL               bool  `json:"mkl"`
+}
+
+// ReadThreading returns the threading configuration the predictor applies
+// to the caffe2 thread pool, OpenMP and the BLAS library.
+func (p *Predictor) ReadThreading() (*ThreadingConfig, error) {
+	cstr := C.ReadThreadingCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil threading configuration")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	config := &ThreadingConfig{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), config); err != nil {
+		return nil, errors.Wrap(err, "failed to decode threading configuration")
+	}
+	return config, nil
+}
+
+// NUMAPages counts the pages of a set of tensors by the numa node they are
+// on relative to the node the predictor is bound to.
+type NUMAPages struct {
+	Local    int64 `json:"local"`
+	Remote   int64 `json:"remote"`
+	Unmapped int64 `json:"unmapped"`
+}
+
+// NUMAReport describes where the predictor memory lives. Parameters and
+// Activations are nil when the predictor is not bound to a numa node.
+type NUMAReport struct {
+	Node        int        `json:"node"`
+	Parameters  *NUMAPages `json:"parameters"`
+	Activations *NUMAPages `json:"activations"`
+}
+
+// ReadNUMA reports the numa placement of the predictor memory.
+func (p *Predictor) ReadNUMA() (*NUMAReport, error) {
+	cstr := C.ReadNumaCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil numa report")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	report := &NUMAReport{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), report); err != nil {
+		return nil, errors.Wrap(err, "failed to decode numa report")
+	}
+	return report, nil
+}
+
+// ArenaStats describes the huge page arena backing the predictor tensors.
+type ArenaStats struct {
+	HugePageSize        int64   `json:"huge_page_size"`
+	Chunks              int64   `json:"chunks"`
+	MappedBytes         int64   `json:"mapped_bytes"`
+	InUseBytes          int64   `json:"in_use_bytes"`
+	HugeTLBBytes        int64   `json:"hugetlb_bytes"`
+	THPAdvisedBytes     int64   `json:"thp_advised_bytes"`
+	THPBackedBytes      int64   `json:"thp_backed_bytes"`
+	HugePageCoverage    float64 `json:"huge_page_coverage"`
+	TLBEntries2M        int64   `json:"tlb_entries_2m"`
+	TLBEntries4K        int64   `json:"tlb_entries_4k"`
+	LockedBytes         int64   `json:"locked_bytes"`
+	LockFailures        int64   `json:"lock_failures"`
+	FallbackAllocations int64   `json:"fallback_allocations"`
+	FreeBytes           int64   `json:"free_bytes"`
+	FreeBlocks          int64   `json:"free_blocks"`
+}
+
+// ReadArena returns the huge page arena statistics of the predictor, or nil
+// when it was not created with HugePages.
+func (p *Predictor) ReadArena() (*ArenaStats, error) {
+	cstr := C.ReadArenaCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil arena statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	s := C.GoString(cstr)
+	if s == "" {
+		return nil, nil
+	}
+	stats := &ArenaStats{}
+	if err := json.Unmarshal([]byte(s), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode arena statistics")
+	}
+	return stats, nil
+}
+
+// PreemptionStats describe how much the runs of a LowPriority predictor
+// have been paused by HighPriority ones.
+type PreemptionStats struct {
+	Priority               Priority `json:"priority"`
+	Preemptions            int64    `json:"preemptions"`
+	PreemptedMilliseconds  float64  `json:"preempted_ms"`
+	ActiveHighPriorityRuns int64    `json:"active_high_priority_runs"`
+}
+
+// ReadPreemption returns the preemption statistics of the predictor.
+func (p *Predictor) ReadPreemption() (*PreemptionStats, error) {
+	cstr := C.ReadPreemptionCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil preemption statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := &PreemptionStats{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode preemption statistics")
+	}
+	return stats, nil
+}
+
+// ObserverOverhead is the cost of the idle profiling observers of a net.
+type ObserverOverhead struct {
+	Iterations               int     `json:"iterations"`
+	Operators                int     `json:"ops"`
+	ObservedMilliseconds     float64 `json:"observed_ms"`
+	UnobservedMilliseconds   float64 `json:"unobserved_ms"`
+	OverheadMilliseconds     float64 `json:"overhead_ms"`
+	OverheadPerOpNanoseconds float64 `json:"overhead_per_op_ns"`
+}
+
+// MeasureObserverOverhead runs the net iterations times with its profiling
+// observers attached but not recording, and as many times without them, on
+// a synthetic input of the given shape.
+func (p *Predictor) MeasureObserverOverhead(ctx context.Context, iterations int, shape Shape) (*ObserverOverhead, error) {
+	if iterations < 1 {
+		return nil, errors.New("iterations must be positive")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_measure_observer_overhead")
+	defer span.Finish()
+
+	cstr := C.MeasureObserverOverheadCaffe2(p.ctx, C.int(iterations), C.int(shape.BatchSize), C.int(shape.Channels), C.int(shape.Width), C.int(shape.Height))
+	if cstr == nil {
+		return nil, errors.New("failed to read nil observer overhead statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := &ObserverOverhead{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode observer overhead statistics")
+	}
+	return stats, nil
+}
+
+// StartExecutor starts the process wide executor. From then on the
+// predictions of every predictor are queued and run by numWorkers threads,
+// HighPriority predictors first and, within a priority, in proportion to
+// the predictor weights.
+func StartExecutor(numWorkers int) error {
+	if numWorkers < 1 {
+		return errors.New("the number of executor workers must be positive")
+	}
+	if C.StartExecutorCaffe2(C.int(numWorkers)) != 0 {
+		return errors.New("failed to start the executor")
+	}
+	return nil
+}
+
+// ModelQueueStats are the queueing metrics of a predictor.
+type ModelQueueStats struct {
+	Priority                  Priority `json:"priority"`
+	Weight                    int      `json:"weight"`
+	Queued                    int64    `json:"queued"`
+	Runs                      int64    `json:"runs"`
+	QueueDelayMilliseconds    float64  `json:"queue_delay_ms"`
+	MaxQueueDelayMilliseconds float64  `json:"max_queue_delay_ms"`
+	RunMilliseconds           float64  `json:"run_ms"`
+}
+
+// ExecutorStats are the state of the process wide executor along with the
+// queueing metrics of a predictor.
+type ExecutorStats struct {
+	Workers      int              `json:"workers"`
+	Queued       int64            `json:"queued"`
+	ActiveModels int              `json:"active_models"`
+	Model        *ModelQueueStats `json:"model"`
+}
+
+// ReadExecutor returns the executor state and the queueing metrics of the
+// predictor.
+func (p *Predictor) ReadExecutor() (*ExecutorStats, error) {
+	cstr := C.ReadExecutorCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil executor statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := &ExecutorStats{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode executor statistics")
+	}
+	return stats, nil
+}
+
+// MemoryUsage is the memory footprint of a predictor.
+type MemoryUsage struct {
+	// ParameterBytes and ActivationBytes are the sizes of the parameter and
+	// activation tensors at their current shape.
+	ParameterBytes  int64
+	ActivationBytes int64
+	// PeakBytes is the peak of the CPU memory allocated by the predictor
+	// during the last prediction and AllocatedBytes what it holds now.
+	PeakBytes      int64
+	AllocatedBytes int64
+	// OutputBytes is the size of the prediction output buffer.
+	OutputBytes int64
+}
+
+// MemoryUsage returns the memory footprint of the predictor.
+func (p *Predictor) MemoryUsage() (*MemoryUsage, error) {
+	var usage C.MemoryUsage
+	ok := C.GetMemoryUsageCaffe2(p.ctx, &usage)
+	if ok != 0 {
+		return nil, errors.New("unable to get caffe2 predictor memory usage")
+	}
+	return &MemoryUsage{
+		ParameterBytes:  int64(usage.parameter_bytes),
+		ActivationBytes: int64(usage.activation_bytes),
+		PeakBytes:       int64(usage.peak_bytes),
+		AllocatedBytes:  int64(usage.allocated_bytes),
+		OutputBytes:     int64(usage.output_bytes),
+	}, nil
+}
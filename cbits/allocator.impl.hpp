@@ -0,0 +1,442 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include <caffe2/core/allocator.h>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+static const size_t huge_page_size = 2 << 20;
+static const size_t arena_alignment = 64;
+// allocations smaller than this are left to the default allocator, since
+// they do not benefit from huge pages
+static const size_t arena_min_allocation = 64 << 10;
+
+static size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+class hugepage_arena;
+
+// arena_block is the context of the data pointers handed out by the arena
+struct arena_block {
+  hugepage_arena *arena;
+  void *ptr;
+  size_t size;
+};
+
+// hugepage_arena serves large allocations out of chunks backed by 2MB pages.
+// Chunks come from hugetlbfs when huge pages are reserved, otherwise from
+// transparent huge pages (madvise). They are pre-faulted, and optionally
+// locked, when mapped so that the first touch of a tensor does not fault.
+// Freed blocks are kept for reuse until the arena is destroyed: they are
+// merged with their free neighbours and served best fit, split when larger
+// than the request, so that mixed sizes do not fragment the chunks.
+class hugepage_arena {
+ public:
+  explicit hugepage_arena(bool lock_memory) : lock_memory_(lock_memory) {}
+
+  ~hugepage_arena() {
+#ifdef __linux__
+    for (const auto &c : chunks_) {
+      if (c.locked) {
+        munlock(c.base, c.size);
+      }
+      munmap(c.base, c.size);
+    }
+#endif  // __linux__
+  }
+
+  arena_block *allocate(size_t nbytes) {
+    const auto size = round_up(nbytes, arena_alignment);
+    std::lock_guard<std::mutex> lock(mut_);
+    char *ptr = take_free(size);
+    if (ptr == nullptr) {
+      if (chunks_.empty() || chunks_.back().size - chunks_.back().used < size) {
+        // the tail of the current chunk is left to the smaller requests
+        if (!chunks_.empty()) {
+          auto &c = chunks_.back();
+          if (c.used < c.size) {
+            add_free(static_cast<char *>(c.base) + c.used, c.size - c.used);
+            c.used = c.size;
+          }
+        }
+        if (!map_chunk(round_up(size, huge_page_size))) {
+          fallback_allocations_++;
+          return nullptr;
+        }
+      }
+      auto &c = chunks_.back();
+      ptr = static_cast<char *>(c.base) + c.used;
+      c.used += size;
+    }
+    in_use_bytes_ += size;
+    return new arena_block{this, ptr, size};
+  }
+
+  void free(arena_block *block) {
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      in_use_bytes_ -= block->size;
+      add_free(static_cast<char *>(block->ptr), block->size);
+    }
+    delete block;
+  }
+
+  json to_json() {
+    std::lock_guard<std::mutex> lock(mut_);
+    size_t mapped = 0, hugetlb = 0, thp_advised = 0, locked = 0,
+           free_bytes = 0;
+    for (const auto &kv : free_by_address_) {
+      free_bytes += kv.second;
+    }
+    for (const auto &c : chunks_) {
+      mapped += c.size;
+      hugetlb += c.hugetlb ? c.size : 0;
+      thp_advised += c.hugetlb ? 0 : c.size;
+      locked += c.locked ? c.size : 0;
+    }
+    // the kernel may not have been able to back every advised range with
+    // huge pages, the actual coverage is what determines the TLB reach
+    const auto thp_backed = thp_backed_bytes();
+    const auto huge_backed = hugetlb + thp_backed;
+    return json{
+        {"huge_page_size", huge_page_size},
+        {"chunks", chunks_.size()},
+        {"mapped_bytes", mapped},
+        {"in_use_bytes", in_use_bytes_},
+        {"hugetlb_bytes", hugetlb},
+        {"thp_advised_bytes", thp_advised},
+        {"thp_backed_bytes", thp_backed},
+        {"huge_page_coverage",
+         mapped == 0 ? 0.0 : static_cast<double>(huge_backed) / mapped},
+        {"tlb_entries_2m", huge_backed / huge_page_size},
+        {"tlb_entries_4k", (mapped - std::min(mapped, huge_backed)) / 4096},
+        {"locked_bytes", locked},
+        {"lock_failures", lock_failures_},
+        {"fallback_allocations", fallback_allocations_},
+        {"free_bytes", free_bytes},
+        {"free_blocks", free_by_address_.size()},
+    };
+  }
+
+ private:
+  struct chunk {
+    void *base;
+    size_t size;
+    size_t used;
+    bool hugetlb;
+    bool locked;
+  };
+
+  // take_free returns the smallest free block of at least size bytes, with
+  // what it has beyond size returned to the free blocks, or nullptr
+  char *take_free(size_t size) {
+    const auto it = free_by_size_.lower_bound({size, nullptr});
+    if (it == free_by_size_.end()) {
+      return nullptr;
+    }
+    const auto block_size = it->first;
+    const auto ptr = it->second;
+    free_by_size_.erase(it);
+    free_by_address_.erase(ptr);
+    // the block was merged with its free neighbours when freed, the rest
+    // of it has none
+    if (block_size > size) {
+      free_by_address_.emplace(ptr + size, block_size - size);
+      free_by_size_.emplace(block_size - size, ptr + size);
+    }
+    return ptr;
+  }
+
+  // add_free returns a block to the free blocks, merged with the free
+  // blocks next to it in the same chunk
+  void add_free(char *ptr, size_t size) {
+    const auto next = free_by_address_.find(ptr + size);
+    if (next != free_by_address_.end() && !is_chunk_base(next->first)) {
+      free_by_size_.erase({next->second, next->first});
+      size += next->second;
+      free_by_address_.erase(next);
+    }
+    auto previous = free_by_address_.lower_bound(ptr);
+    if (previous != free_by_address_.begin() && !is_chunk_base(ptr)) {
+      --previous;
+      if (previous->first + previous->second == ptr) {
+        free_by_size_.erase({previous->second, previous->first});
+        ptr = previous->first;
+        size += previous->second;
+        free_by_address_.erase(previous);
+      }
+    }
+    free_by_address_.emplace(ptr, size);
+    free_by_size_.emplace(size, ptr);
+  }
+
+  // chunks mapped next to each other are not merged across, since they
+  // may differ in page size and locking
+  bool is_chunk_base(const char *ptr) const {
+    for (const auto &c : chunks_) {
+      if (c.base == ptr) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool map_chunk(size_t size) {
+#ifdef __linux__
+    chunk c{nullptr, size, 0, false, false};
+#ifdef MAP_HUGETLB
+    c.base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    c.hugetlb = c.base != MAP_FAILED;
+#endif  // MAP_HUGETLB
+    if (!c.hugetlb) {
+      // over-allocate to be able to align the chunk on a huge page boundary
+      auto base = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED) {
+        return false;
+      }
+      const auto addr = reinterpret_cast<uintptr_t>(base);
+      const auto aligned = round_up(addr, huge_page_size);
+      if (aligned != addr) {
+        munmap(base, aligned - addr);
+      }
+      munmap(reinterpret_cast<void *>(aligned + size),
+             addr + huge_page_size - aligned);
+      c.base = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+      madvise(c.base, size, MADV_HUGEPAGE);
+#endif  // MADV_HUGEPAGE
+    }
+    // pre-fault the chunk, one write per small page is enough to populate
+    // it whether or not the kernel backs it with huge pages
+    auto bytes = static_cast<volatile char *>(c.base);
+    for (size_t offset = 0; offset < size; offset += 4096) {
+      bytes[offset] = 0;
+    }
+    if (lock_memory_) {
+      c.locked = mlock(c.base, size) == 0;
+      lock_failures_ += c.locked ? 0 : 1;
+    }
+    chunks_.emplace_back(c);
+    return true;
+#else   // __linux__
+    return false;
+#endif  // __linux__
+  }
+
+  // thp_backed_bytes sums the AnonHugePages of the arena chunks as reported
+  // by /proc/self/smaps
+  size_t thp_backed_bytes() const {
+    size_t total = 0;
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool in_arena = false;
+    while (std::getline(smaps, line)) {
+      const auto dash = line.find('-');
+      const auto space = line.find(' ');
+      if (dash != std::string::npos && space != std::string::npos &&
+          dash < space && line.find(':') > space) {
+        const auto start = std::stoull(line.substr(0, dash), nullptr, 16);
+        const auto end =
+            std::stoull(line.substr(dash + 1, space - dash - 1), nullptr, 16);
+        in_arena = false;
+        for (const auto &c : chunks_) {
+          const auto base = reinterpret_cast<uintptr_t>(c.base);
+          in_arena |= !c.hugetlb && start < base + c.size && end > base;
+        }
+        continue;
+      }
+      if (in_arena && line.compare(0, 14, "AnonHugePages:") == 0) {
+        std::stringstream ss(line.substr(14));
+        size_t kb = 0;
+        ss >> kb;
+        total += kb << 10;
+      }
+    }
+    return total;
+  }
+
+  bool lock_memory_{false};
+  std::mutex mut_;
+  std::vector<chunk> chunks_{};
+  // the free blocks, by address to merge them and by size to serve them
+  std::map<char *, size_t> free_by_address_{};
+  std::set<std::pair<size_t, char *>> free_by_size_{};
+  size_t in_use_bytes_{0};
+  size_t lock_failures_{0};
+  size_t fallback_allocations_{0};
+};
+
+// allocation_observer is told about the allocations and frees accounted
+// for by a tracker, with the live bytes that result from them
+struct allocation_observer {
+  virtual ~allocation_observer() {}
+  virtual void allocated(size_t nbytes, int64_t live_bytes) = 0;
+  virtual void freed(size_t nbytes, int64_t live_bytes) = 0;
+};
+
+// allocation_tracker accounts for the CPU memory allocated on behalf of a
+// predictor
+struct allocation_tracker {
+  void allocated(size_t nbytes) {
+    const auto live = live_bytes_ += nbytes;
+    auto peak = peak_bytes_.load();
+    while (live > peak && !peak_bytes_.compare_exchange_weak(peak, live)) {
+    }
+    const auto observer = observer_.load(std::memory_order_acquire);
+    if (observer != nullptr) {
+      observer->allocated(nbytes, live);
+    }
+  }
+
+  void freed(size_t nbytes) {
+    const auto live = live_bytes_ -= nbytes;
+    const auto observer = observer_.load(std::memory_order_acquire);
+    if (observer != nullptr) {
+      observer->freed(nbytes, live);
+    }
+  }
+
+  // set_observer installs the observer of the tracker, null to remove it.
+  // The tracker outlives its predictor when tensors are freed late, so the
+  // observer must be removed before it is destroyed.
+  void set_observer(allocation_observer *observer) {
+    observer_.store(observer, std::memory_order_release);
+  }
+
+  // reset_peak starts a new peak measurement from the current live bytes
+  void reset_peak() { peak_bytes_ = live_bytes_.load(); }
+
+  int64_t live_bytes() const { return live_bytes_; }
+  int64_t peak_bytes() const { return peak_bytes_; }
+
+ private:
+  std::atomic<int64_t> live_bytes_{0}, peak_bytes_{0};
+  std::atomic<allocation_observer *> observer_{nullptr};
+};
+
+// tracked_allocation is the context of the data pointers handed out while
+// an allocation_tracker is in scope. It wraps the context of the underlying
+// allocation.
+struct tracked_allocation {
+  std::shared_ptr<allocation_tracker> tracker;
+  void *ctx;
+  at::DeleterFnPtr deleter;
+  size_t size;
+};
+
+// allocation_context is what the allocator routes the allocations of the
+// calling thread to. layer is the layer_sequence_index of the operator the
+// thread runs while it is profiled, -1 otherwise, which the allocations and
+// frees are attributed to.
+struct allocation_context {
+  hugepage_arena *arena{nullptr};
+  std::shared_ptr<allocation_tracker> tracker{nullptr};
+  int layer{-1};
+};
+
+static allocation_context &current_allocation_context() {
+  static thread_local allocation_context context{};
+  return context;
+}
+
+// allocation_scope routes the CPU allocations made by the calling thread to
+// a predictor for the duration of the scope: the large ones are carved out
+// of its arena (when it has one) and all of them are accounted for by its
+// tracker
+class allocation_scope {
+ public:
+  allocation_scope(hugepage_arena *arena,
+                   std::shared_ptr<allocation_tracker> tracker)
+      : previous_(current_allocation_context()) {
+    auto &context = current_allocation_context();
+    context.arena = arena;
+    context.tracker = std::move(tracker);
+  }
+  ~allocation_scope() { current_allocation_context() = previous_; }
+
+ private:
+  allocation_context previous_;
+};
+
+// predictor_allocator replaces the Caffe2 CPU allocator. It forwards to the
+// allocator it replaced unless the allocating thread is inside an
+// allocation_scope.
+class predictor_allocator final : public at::Allocator {
+ public:
+  explicit predictor_allocator(at::Allocator *base) : base_(base) {}
+
+  at::DataPtr allocate(size_t nbytes) const override {
+    const auto &context = current_allocation_context();
+    at::DataPtr data_ptr;
+    if (context.arena != nullptr && nbytes >= arena_min_allocation) {
+      auto block = context.arena->allocate(nbytes);
+      if (block != nullptr) {
+        data_ptr = at::DataPtr(block->ptr, block, &delete_arena_block,
+                               at::Device(caffe2::CPU));
+      }
+    }
+    if (!data_ptr) {
+      data_ptr = base_->allocate(nbytes);
+    }
+    if (context.tracker == nullptr || !data_ptr) {
+      return data_ptr;
+    }
+    context.tracker->allocated(nbytes);
+    const auto data = data_ptr.get();
+    const auto deleter = data_ptr.get_deleter();
+    auto allocation = new tracked_allocation{
+        context.tracker, data_ptr.release_context(), deleter, nbytes};
+    return at::DataPtr(data, allocation, &delete_tracked_allocation,
+                       at::Device(caffe2::CPU));
+  }
+
+  static void install() {
+    static std::once_flag flag;
+    std::call_once(flag, [] {
+      static predictor_allocator allocator(caffe2::GetCPUAllocator());
+      caffe2::SetCPUAllocator(&allocator);
+    });
+  }
+
+ private:
+  static void delete_arena_block(void *ctx) {
+    auto block = static_cast<arena_block *>(ctx);
+    block->arena->free(block);
+  }
+
+  static void delete_tracked_allocation(void *ctx) {
+    auto allocation = static_cast<tracked_allocation *>(ctx);
+    allocation->tracker->freed(allocation->size);
+    if (allocation->deleter != nullptr) {
+      allocation->deleter(allocation->ctx);
+    }
+    delete allocation;
+  }
+
+  at::Allocator *base_;
+};
+
+}  // namespace mlmodelscope
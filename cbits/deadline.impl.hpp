@@ -0,0 +1,126 @@
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <caffe2/core/observer.h>
+#include <caffe2/core/operator.h>
+
+#include "preemption.impl.hpp"
+#include "timer.h"
+
+namespace mlmodelscope {
+
+// cancel_token is shared between a run and whoever may cancel it, it can be
+// cancelled before the run starts
+struct cancel_token {
+  std::atomic<bool> cancelled{false};
+};
+
+// run_aborted is thrown out of a run that was stopped between operators
+class run_aborted : public std::runtime_error {
+ public:
+  explicit run_aborted(error_t code)
+      : std::runtime_error(code == error_cancelled ? "run cancelled"
+                                                   : "run deadline exceeded"),
+        code_(code) {}
+
+  error_t code() const { return code_; }
+
+ private:
+  error_t code_;
+};
+
+// run_control holds the deadline, the cancel token and the preemptibility
+// of the run in progress on a net. It is disarmed between runs so that the
+// operators pay a single atomic load when none of them is set.
+class run_control {
+ public:
+  using clock_t = std::chrono::steady_clock;
+
+  // arm sets up the checks for the next run, timeout_us <= 0 means no
+  // deadline and token may be null. A preemptible run is paused between
+  // operators while high priority runs are in progress.
+  void arm(int64_t timeout_us, cancel_token *token, bool preemptible) {
+    has_deadline_ = timeout_us > 0;
+    if (has_deadline_) {
+      deadline_ = clock_t::now() + std::chrono::microseconds(timeout_us);
+    }
+    token_ = token;
+    preemptible_ = preemptible;
+    aborted_ = success;
+    armed_.store(has_deadline_ || token_ != nullptr || preemptible_,
+                 std::memory_order_release);
+  }
+
+  void disarm() { armed_.store(false, std::memory_order_release); }
+
+  // check throws run_aborted when the run should stop, and holds a
+  // preemptible run while it is preempted
+  void check() {
+    if (!armed_.load(std::memory_order_acquire)) {
+      return;
+    }
+    check_abort();
+    auto &gate = preemption_gate::global();
+    if (!preemptible_ || !gate.busy()) {
+      return;
+    }
+    const auto start = clock_t::now();
+    preemptions_++;
+    // the deadline and the token keep being honored while paused
+    while (gate.wait(std::chrono::milliseconds(1))) {
+      check_abort();
+    }
+    preempted_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         clock_t::now() - start)
+                         .count();
+  }
+
+  // aborted returns why the last run was stopped, or success. Executors
+  // that run operators on their own threads may surface the exception
+  // thrown by check as a generic failure, this is the source of truth.
+  error_t aborted() const { return aborted_; }
+
+  int64_t preemptions() const { return preemptions_; }
+  int64_t preempted_ns() const { return preempted_ns_; }
+
+ private:
+  void check_abort() {
+    error_t code = success;
+    if (token_ != nullptr && token_->cancelled.load()) {
+      code = error_cancelled;
+    } else if (has_deadline_ && clock_t::now() >= deadline_) {
+      code = error_deadline_exceeded;
+    }
+    if (code != success) {
+      aborted_ = code;
+      throw run_aborted(code);
+    }
+  }
+
+  std::atomic<bool> armed_{false};
+  bool has_deadline_{false};
+  bool preemptible_{false};
+  clock_t::time_point deadline_{};
+  cancel_token *token_{nullptr};
+  std::atomic<error_t> aborted_{success};
+  std::atomic<int64_t> preemptions_{0}, preempted_ns_{0};
+};
+
+// deadline_observer checks the run_control of its net before each operator
+class deadline_observer final
+    : public caffe2::ObserverBase<caffe2::OperatorBase> {
+ public:
+  deadline_observer(caffe2::OperatorBase *op, run_control *control)
+      : caffe2::ObserverBase<caffe2::OperatorBase>(op), control_(control) {}
+
+ private:
+  void Start() override { control_->check(); }
+
+  run_control *control_;
+};
+
+}  // namespace mlmodelscope
@@ -0,0 +1,217 @@
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "predictor.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// model_queue holds the runs a predictor submitted to the executor along
+// with its share of the executor and its queueing metrics
+struct model_queue {
+  using clock_t = std::chrono::steady_clock;
+
+  struct task {
+    std::function<void()> fn;
+    clock_t::time_point submitted;
+    std::exception_ptr error{nullptr};
+    // set, and the submitter alone notified, under the executor mutex
+    bool done{false};
+    std::condition_variable finished{};
+  };
+
+  model_queue(Priority priority, int weight)
+      : priority(priority), weight(std::max(weight, 1)) {}
+
+  json to_json() const {
+    const auto completed = runs.load();
+    return json{
+        {"priority", priority},
+        {"weight", weight},
+        {"queued", queued.load()},
+        {"runs", completed},
+        {"queue_delay_ms",
+         completed == 0 ? 0.0 : queue_ns.load() / 1.0e6 / completed},
+        {"max_queue_delay_ms", max_queue_ns.load() / 1.0e6},
+        {"run_ms", completed == 0 ? 0.0 : run_ns.load() / 1.0e6 / completed},
+    };
+  }
+
+  const Priority priority;
+  const int weight;
+
+  // guarded by the executor mutex
+  std::deque<task *> tasks{};
+  // a predictor cannot run concurrently, a model whose run is in progress
+  // is out of the active models until the run is over
+  bool running{false};
+  // virtual time of the model within its priority class, it advances by
+  // the cost of each run divided by the weight
+  double pass{0};
+  // moving average of the run time, used as the cost of the next run
+  double cost_ns{1.0e6};
+
+  std::atomic<int64_t> queued{0}, runs{0}, queue_ns{0}, max_queue_ns{0},
+      run_ns{0};
+};
+
+// run_executor is the process wide pool that runs the predictions once it
+// is started. Queued runs are served by priority class first. Within a
+// class, the models get worker time in proportion to their weights: the
+// model with the least virtual time runs next and a model that was idle
+// does not accumulate credit over the others.
+class run_executor {
+ public:
+  static run_executor &global() {
+    // never destroyed, the workers may still be running at exit
+    static auto executor = new run_executor();
+    return *executor;
+  }
+
+  void start(int num_workers) {
+    if (num_workers <= 0) {
+      throw std::invalid_argument("the number of workers must be positive");
+    }
+    std::lock_guard<std::mutex> lock(mut_);
+    if (num_workers_ != 0) {
+      throw std::invalid_argument("the executor is already started");
+    }
+    num_workers_ = num_workers;
+    for (int ii = 0; ii < num_workers; ii++) {
+      std::thread([this] { work(); }).detach();
+    }
+    started_ = true;
+  }
+
+  bool started() const { return started_.load(std::memory_order_acquire); }
+
+  // run queues fn on behalf of the model and blocks until a worker ran it,
+  // rethrowing what it threw
+  void run(const std::shared_ptr<model_queue> &model,
+           std::function<void()> fn) {
+    model_queue::task t;
+    t.fn = std::move(fn);
+    t.submitted = model_queue::clock_t::now();
+    std::unique_lock<std::mutex> lock(mut_);
+    if (model->tasks.empty() && !model->running) {
+      // an idle model restarts from the current virtual time of its class
+      model->pass = std::max(model->pass, class_pass_[model->priority]);
+      active_.emplace_back(model);
+    }
+    model->tasks.emplace_back(&t);
+    model->queued++;
+    queued_++;
+    work_.notify_one();
+    t.finished.wait(lock, [&t] { return t.done; });
+    if (t.error != nullptr) {
+      std::rethrow_exception(t.error);
+    }
+  }
+
+  json to_json() {
+    std::lock_guard<std::mutex> lock(mut_);
+    return json{
+        {"workers", num_workers_},
+        {"queued", queued_},
+        {"active_models", active_.size()},
+    };
+  }
+
+ private:
+  static int rank(Priority priority) {
+    return priority == HIGH_PRIORITY ? 2 : priority == NORMAL_PRIORITY ? 1 : 0;
+  }
+
+  // next returns the model whose run is served next and takes it out of the
+  // active models while the run is in progress
+  std::shared_ptr<model_queue> next() {
+    auto best = active_.end();
+    for (auto it = active_.begin(); it != active_.end(); ++it) {
+      if (best == active_.end() ||
+          rank((*it)->priority) > rank((*best)->priority) ||
+          ((*it)->priority == (*best)->priority &&
+           (*it)->pass < (*best)->pass)) {
+        best = it;
+      }
+    }
+    auto model = *best;
+    class_pass_[model->priority] = model->pass;
+    active_.erase(best);
+    model->running = true;
+    return model;
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mut_);
+    while (true) {
+      work_.wait(lock, [this] { return !active_.empty(); });
+      auto model = next();
+      auto t = model->tasks.front();
+      model->tasks.pop_front();
+      model->pass += model->cost_ns / model->weight;
+      queued_--;
+      lock.unlock();
+
+      const auto start = model_queue::clock_t::now();
+      const int64_t queue_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(start -
+                                                               t->submitted)
+              .count();
+      try {
+        t->fn();
+      } catch (...) {
+        t->error = std::current_exception();
+      }
+      const int64_t run_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              model_queue::clock_t::now() - start)
+              .count();
+      model->queued--;
+      model->runs++;
+      model->queue_ns += queue_ns;
+      auto max_queue_ns = model->max_queue_ns.load();
+      while (queue_ns > max_queue_ns &&
+             !model->max_queue_ns.compare_exchange_weak(max_queue_ns,
+                                                        queue_ns)) {
+      }
+      model->run_ns += run_ns;
+
+      lock.lock();
+      model->cost_ns = 0.8 * model->cost_ns + 0.2 * run_ns;
+      model->running = false;
+      if (!model->tasks.empty()) {
+        active_.emplace_back(model);
+        work_.notify_one();
+      }
+      // the task lives on the stack of the submitter, which cannot return
+      // before the lock is released
+      t->done = true;
+      t->finished.notify_one();
+    }
+  }
+
+  std::mutex mut_;
+  std::condition_variable work_;
+  std::atomic<bool> started_{false};
+  int num_workers_{0};
+  int64_t queued_{0};
+  // models that have queued runs and none in progress
+  std::vector<std::shared_ptr<model_queue>> active_{};
+  double class_pass_[HIGH_PRIORITY + 1] = {0, 0, 0};
+};
+
+}  // namespace mlmodelscope
@@ -0,0 +1,169 @@
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// memory policy constants from linux/mempolicy.h, the numa syscalls are
+// invoked directly so that libnuma is not required
+static const int numa_mpol_default = 0;
+static const int numa_mpol_preferred = 1;
+static const int numa_mpol_mf_move = 1 << 1;
+static const unsigned long numa_max_nodes = 1024;
+
+using memory_range_t = std::pair<const void *, size_t>;
+
+// numa_node_cpus parses the cpulist (e.g. "0-15,32-47") of a numa node
+static std::vector<int> numa_node_cpus(int node) {
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+  if (!file) {
+    throw std::invalid_argument("numa node " + std::to_string(node) +
+                                " does not exist");
+  }
+  std::string list;
+  std::getline(file, list);
+  std::vector<int> cpus{};
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    const auto dash = range.find('-');
+    const auto first = std::stoi(range.substr(0, dash));
+    const auto last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.emplace_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// numa_scope makes the memory first touched by the calling thread land on a
+// numa node for the duration of the scope. The node is preferred rather
+// than required, so allocations still succeed when the node is full.
+class numa_scope {
+ public:
+  explicit numa_scope(int node) {
+#ifdef __linux__
+    if (node < 0) {
+      return;
+    }
+    if (syscall(SYS_get_mempolicy, &previous_mode_, previous_mask_.data(),
+                numa_max_nodes, nullptr, 0) != 0) {
+      return;
+    }
+    std::vector<unsigned long> mask(previous_mask_.size(), 0);
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    restore_ = syscall(SYS_set_mempolicy, numa_mpol_preferred, mask.data(),
+                       numa_max_nodes) == 0;
+#endif  // __linux__
+  }
+
+  ~numa_scope() {
+#ifdef __linux__
+    if (!restore_) {
+      return;
+    }
+    if (previous_mode_ == numa_mpol_default) {
+      syscall(SYS_set_mempolicy, numa_mpol_default, nullptr, 0);
+    } else {
+      syscall(SYS_set_mempolicy, previous_mode_, previous_mask_.data(),
+              numa_max_nodes);
+    }
+#endif  // __linux__
+  }
+
+ private:
+  int previous_mode_{numa_mpol_default};
+  std::vector<unsigned long> previous_mask_ =
+      std::vector<unsigned long>(numa_max_nodes / (8 * sizeof(unsigned long)));
+  bool restore_{false};
+};
+
+// numa_pages counts the pages of a set of memory ranges by where they live
+struct numa_pages {
+  int64_t local{0}, remote{0}, unmapped{0};
+
+  json to_json() const {
+    return json{
+        {"local", local}, {"remote", remote}, {"unmapped", unmapped}};
+  }
+};
+
+static std::vector<void *> page_addresses(
+    const std::vector<memory_range_t> &ranges) {
+  std::vector<void *> pages{};
+#ifdef __linux__
+  const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  for (const auto &range : ranges) {
+    if (range.first == nullptr || range.second == 0) {
+      continue;
+    }
+    const auto begin = reinterpret_cast<uintptr_t>(range.first);
+    for (auto page = begin & ~(page_size - 1); page < begin + range.second;
+         page += page_size) {
+      pages.emplace_back(reinterpret_cast<void *>(page));
+    }
+  }
+#endif  // __linux__
+  return pages;
+}
+
+// numa_migrate moves the pages of the ranges that are not on the node to it
+// and returns the resulting page placement
+static numa_pages numa_migrate(const std::vector<memory_range_t> &ranges,
+                               int node, bool move) {
+  numa_pages result{};
+#ifdef __linux__
+  const auto pages = page_addresses(ranges);
+  const size_t batch = 1024;
+  std::vector<int> nodes(batch, node), status(batch, 0);
+  for (size_t offset = 0; offset < pages.size(); offset += batch) {
+    const auto count = std::min(batch, pages.size() - offset);
+    auto addresses = const_cast<void **>(pages.data() + offset);
+    if (syscall(SYS_move_pages, 0, count, addresses,
+                move ? nodes.data() : nullptr, status.data(),
+                move ? numa_mpol_mf_move : 0) < 0) {
+      result.unmapped += count;
+      continue;
+    }
+    for (size_t ii = 0; ii < count; ii++) {
+      if (status[ii] < 0) {
+        result.unmapped++;
+      } else if (status[ii] == node) {
+        result.local++;
+      } else {
+        result.remote++;
+      }
+    }
+  }
+#endif  // __linux__
+  return result;
+}
+
+// numa_query returns the page placement of the ranges relative to the node
+static numa_pages numa_query(const std::vector<memory_range_t> &ranges,
+                             int node) {
+  return numa_migrate(ranges, node, false);
+}
+
+}  // namespace mlmodelscope
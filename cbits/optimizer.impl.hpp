@@ -0,0 +1,539 @@
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <caffe2/core/operator.h>
+#include <caffe2/core/tensor.h>
+#include <caffe2/core/workspace.h>
+#include <caffe2/proto/caffe2.pb.h>
+#include <caffe2/utils/proto_utils.h>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// optimization_report records the rewrites applied by the optimizer passes
+struct optimization_report {
+  void add(std::string pass, std::string detail) {
+    rewrites_.emplace_back(pass, detail);
+  }
+
+  void set_op_counts(int before, int after) {
+    ops_before_ = before;
+    ops_after_ = after;
+  }
+
+  json to_json() const {
+    json rewrites = json::array();
+    for (const auto &r : rewrites_) {
+      rewrites.emplace_back(json{{"pass", r.first}, {"detail", r.second}});
+    }
+    return json{
+        {"ops_before", ops_before_},
+        {"ops_after", ops_after_},
+        {"rewrites", rewrites},
+    };
+  }
+
+  std::string read() const { return to_json().dump(); }
+
+ private:
+  std::vector<std::pair<std::string, std::string>> rewrites_{};
+  int ops_before_{0}, ops_after_{0};
+};
+
+static std::string op_description(const caffe2::OperatorDef &op) {
+  std::string desc = op.type();
+  if (op.has_name() && !op.name().empty()) {
+    desc += "(" + op.name() + ")";
+  } else if (op.output_size() > 0) {
+    desc += "(" + op.output(0) + ")";
+  }
+  return desc;
+}
+
+static bool is_test_op(const caffe2::OperatorDef &op) {
+  return caffe2::ArgumentHelper::GetSingleArgument<caffe2::OperatorDef, int>(
+             op, "is_test", 0) != 0;
+}
+
+static bool is_external_output(const caffe2::NetDef &net,
+                               const std::string &blob) {
+  for (const auto &out : net.external_output()) {
+    if (out == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool is_external_input(const caffe2::NetDef &net,
+                              const std::string &blob) {
+  for (const auto &in : net.external_input()) {
+    if (in == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// number of times blob is read by the operators of the net, skipping the
+// operator at index `except`
+static int count_readers(const caffe2::NetDef &net, const std::string &blob,
+                         int except = -1) {
+  int count = 0;
+  for (int ii = 0; ii < net.op_size(); ii++) {
+    if (ii == except) {
+      continue;
+    }
+    for (const auto &in : net.op(ii).input()) {
+      if (in == blob) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// number of operators that write to blob, skipping the operator at index
+// `except`
+static int count_writers(const caffe2::NetDef &net, const std::string &blob,
+                         int except = -1) {
+  int count = 0;
+  for (int ii = 0; ii < net.op_size(); ii++) {
+    if (ii == except) {
+      continue;
+    }
+    for (const auto &out : net.op(ii).output()) {
+      if (out == blob) {
+        count++;
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+// index of the last operator before `before` that writes to blob
+static int find_producer(const caffe2::NetDef &net, const std::string &blob,
+                         int before) {
+  for (int ii = before - 1; ii >= 0; ii--) {
+    for (const auto &out : net.op(ii).output()) {
+      if (out == blob) {
+        return ii;
+      }
+    }
+  }
+  return -1;
+}
+
+static bool reads_blob(const caffe2::OperatorDef &op,
+                       const std::string &blob) {
+  for (const auto &in : op.input()) {
+    if (in == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool writes_blob(const caffe2::OperatorDef &op,
+                        const std::string &blob) {
+  for (const auto &out : op.output()) {
+    if (out == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// a blob is private to a producer/consumer pair when nothing else in the
+// net or outside of it can observe the value the producer writes to it.
+// That value lives until the next operator that writes the blob, which is
+// the consumer itself when it runs in-place (e.g. a SpatialBN or a Relu
+// writing X to X), in which case the later readers of the blob read the
+// output of the consumer.
+static bool is_private_edge(const caffe2::NetDef &net, const std::string &blob,
+                            int producer, int consumer) {
+  if (producer < 0 || is_external_input(net, blob)) {
+    return false;
+  }
+  int overwriter = producer + 1;
+  while (overwriter < net.op_size() &&
+         !writes_blob(net.op(overwriter), blob)) {
+    overwriter++;
+  }
+  if (overwriter == net.op_size() && is_external_output(net, blob)) {
+    return false;
+  }
+  for (int ii = producer + 1; ii < net.op_size() && ii <= overwriter; ii++) {
+    if (ii != consumer && reads_blob(net.op(ii), blob)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static caffe2::Tensor *get_cpu_float_tensor(caffe2::Workspace *ws,
+                                            const std::string &name) {
+  auto blob = ws->GetBlob(name);
+  if (blob == nullptr || !caffe2::BlobIsTensorType(*blob, caffe2::CPU)) {
+    return nullptr;
+  }
+  auto tensor = caffe2::BlobGetMutableTensor(blob, caffe2::CPU);
+  if (!tensor->IsType<float>()) {
+    return nullptr;
+  }
+  return tensor;
+}
+
+// returns the bias tensor of a conv operator, creating a zero bias when the
+// operator does not have one
+static caffe2::Tensor *get_or_create_conv_bias(caffe2::Workspace *ws,
+                                               caffe2::OperatorDef *conv,
+                                               const int64_t num_outputs) {
+  if (conv->input_size() > 2) {
+    return get_cpu_float_tensor(ws, conv->input(2));
+  }
+  auto name = conv->input(1) + "_folded_bias";
+  while (ws->HasBlob(name)) {
+    name += "_";
+  }
+  auto tensor = caffe2::BlobGetMutableTensor(ws->CreateBlob(name), caffe2::CPU);
+  tensor->Resize(num_outputs);
+  auto data = tensor->mutable_data<float>();
+  std::fill(data, data + num_outputs, 0.0f);
+  conv->add_input(name);
+  return tensor;
+}
+
+// removes operators that are identities at inference time (e.g. test mode
+// Dropout) by rewiring their consumers to the operator input
+static void remove_noop_operators(caffe2::NetDef *net,
+                                  optimization_report *report) {
+  static const std::unordered_set<std::string> identity_ops{
+      "Alias", "StopGradient", "Identity"};
+  for (int ii = 0; ii < net->op_size(); ii++) {
+    const auto &op = net->op(ii);
+    const auto noop = identity_ops.count(op.type()) != 0 ||
+                      (op.type() == "Dropout" && is_test_op(op));
+    if (!noop || op.input_size() != 1 || op.output_size() < 1) {
+      continue;
+    }
+    const auto in = op.input(0), out = op.output(0);
+    bool extra_outputs_used = false;
+    for (int jj = 1; jj < op.output_size(); jj++) {
+      extra_outputs_used |= count_readers(*net, op.output(jj)) != 0 ||
+                            is_external_output(*net, op.output(jj));
+    }
+    if (extra_outputs_used) {
+      continue;
+    }
+    if (in != out) {
+      // the readers of out are rewired to in, which must not be written
+      // again
+      if (is_external_output(*net, out) || count_writers(*net, in) != 1 ||
+          !is_private_edge(*net, in, find_producer(*net, in, ii), ii)) {
+        continue;
+      }
+      for (int jj = ii + 1; jj < net->op_size(); jj++) {
+        auto later = net->mutable_op(jj);
+        for (int kk = 0; kk < later->input_size(); kk++) {
+          if (later->input(kk) == out) {
+            later->set_input(kk, in);
+          }
+        }
+        for (int kk = 0; kk < later->output_size(); kk++) {
+          if (later->output(kk) == out) {
+            later->set_output(kk, in);
+          }
+        }
+      }
+    }
+    report->add("remove_noop", op_description(op));
+    net->mutable_op()->DeleteSubrange(ii, 1);
+    ii--;
+  }
+}
+
+// folds inference mode SpatialBN operators into the weights and bias of the
+// convolution that produces their input
+static void fold_batch_norm(caffe2::NetDef *net, caffe2::Workspace *ws,
+                            optimization_report *report) {
+  for (int ii = 0; ii < net->op_size(); ii++) {
+    const auto &bn = net->op(ii);
+    if (bn.type() != "SpatialBN" || !is_test_op(bn) || bn.input_size() != 5 ||
+        bn.output_size() != 1) {
+      continue;
+    }
+    const auto conv_idx = find_producer(*net, bn.input(0), ii);
+    if (conv_idx < 0 || net->op(conv_idx).type() != "Conv" ||
+        !is_private_edge(*net, bn.input(0), conv_idx, ii)) {
+      continue;
+    }
+    auto conv = net->mutable_op(conv_idx);
+    if (count_readers(*net, conv->input(1)) != 1 ||
+        (conv->input_size() > 2 && count_readers(*net, conv->input(2)) != 1)) {
+      continue;  // the weights are shared with another operator
+    }
+    auto weight = get_cpu_float_tensor(ws, conv->input(1));
+    auto scale = get_cpu_float_tensor(ws, bn.input(1));
+    auto bias = get_cpu_float_tensor(ws, bn.input(2));
+    auto mean = get_cpu_float_tensor(ws, bn.input(3));
+    auto var = get_cpu_float_tensor(ws, bn.input(4));
+    if (weight == nullptr || scale == nullptr || bias == nullptr ||
+        mean == nullptr || var == nullptr || weight->ndim() < 1) {
+      continue;
+    }
+    const int64_t num_outputs = weight->dim(0);
+    if (scale->size() != num_outputs || bias->size() != num_outputs ||
+        mean->size() != num_outputs || var->size() != num_outputs) {
+      continue;
+    }
+    auto conv_bias = get_or_create_conv_bias(ws, conv, num_outputs);
+    if (conv_bias == nullptr || conv_bias->size() != num_outputs) {
+      continue;
+    }
+
+    const auto epsilon =
+        caffe2::ArgumentHelper::GetSingleArgument<caffe2::OperatorDef, float>(
+            bn, "epsilon", 1e-5f);
+    const auto per_output = weight->size() / num_outputs;
+    auto w = weight->mutable_data<float>();
+    auto b = conv_bias->mutable_data<float>();
+    const auto s = scale->data<float>(), beta = bias->data<float>(),
+               mu = mean->data<float>(), sigma2 = var->data<float>();
+    for (int64_t oc = 0; oc < num_outputs; oc++) {
+      const auto factor = s[oc] / std::sqrt(sigma2[oc] + epsilon);
+      for (int64_t jj = 0; jj < per_output; jj++) {
+        w[oc * per_output + jj] *= factor;
+      }
+      b[oc] = (b[oc] - mu[oc]) * factor + beta[oc];
+    }
+
+    report->add("fold_batch_norm",
+                op_description(bn) + " into " + op_description(*conv));
+    conv->set_output(0, bn.output(0));
+    net->mutable_op()->DeleteSubrange(ii, 1);
+    ii--;
+  }
+}
+
+// fuses Relu operators into the convolution that produces their input when
+// the convolution engine (or a ConvRelu operator) supports it
+static void fuse_conv_relu(caffe2::NetDef *net, optimization_report *report) {
+  const auto has_conv_relu = caffe2::CPUOperatorRegistry()->Has("ConvRelu");
+  for (int ii = 0; ii < net->op_size(); ii++) {
+    const auto &relu = net->op(ii);
+    if (relu.type() != "Relu" || relu.input_size() != 1 ||
+        relu.output_size() != 1) {
+      continue;
+    }
+    const auto conv_idx = find_producer(*net, relu.input(0), ii);
+    if (conv_idx < 0 || net->op(conv_idx).type() != "Conv" ||
+        !is_private_edge(*net, relu.input(0), conv_idx, ii)) {
+      continue;
+    }
+    auto conv = net->mutable_op(conv_idx);
+    if (conv->engine() == "NNPACK") {
+      // the NNPACK convolution applies the activation in its output transform
+      bool has_activation = false;
+      for (const auto &arg : conv->arg()) {
+        has_activation |= arg.name() == "activation";
+      }
+      if (has_activation) {
+        continue;
+      }
+      *conv->add_arg() = caffe2::MakeArgument<std::string>("activation", "Relu");
+    } else if (has_conv_relu) {
+      conv->set_type("ConvRelu");
+    } else {
+      continue;
+    }
+    report->add("fuse_conv_relu",
+                op_description(relu) + " into " + op_description(*conv));
+    conv->set_output(0, relu.output(0));
+    net->mutable_op()->DeleteSubrange(ii, 1);
+    ii--;
+  }
+}
+
+// fold_input_normalization folds the per channel `(x - mean) / std` input
+// normalization into the weights and bias of the convolution that consumes
+// the input, so that unnormalized inputs can be fed to the net. The fold is
+// only exact when the convolution does not pad its input, since padded
+// elements are zero in the normalized space.
+static void fold_input_normalization(caffe2::NetDef *net, caffe2::Workspace *ws,
+                                     const std::string &input,
+                                     const std::vector<float> &mean,
+                                     const std::vector<float> &std,
+                                     optimization_report *report) {
+  if (mean.empty() || mean.size() != std.size()) {
+    throw std::invalid_argument(
+        "input normalization mean and std must have the same non-zero length");
+  }
+  for (const auto v : std) {
+    if (v == 0) {
+      throw std::invalid_argument("input normalization std must be non-zero");
+    }
+  }
+  int conv_idx = -1;
+  for (int ii = 0; ii < net->op_size() && conv_idx < 0; ii++) {
+    for (const auto &in : net->op(ii).input()) {
+      if (in == input) {
+        conv_idx = ii;
+        break;
+      }
+    }
+  }
+  if (conv_idx < 0 || net->op(conv_idx).type() != "Conv" ||
+      net->op(conv_idx).input(0) != input || count_readers(*net, input) != 1) {
+    throw std::invalid_argument(
+        "cannot fold input normalization: the input is not consumed by a "
+        "single convolution");
+  }
+  auto conv = net->mutable_op(conv_idx);
+  for (const auto &arg : conv->arg()) {
+    const auto &name = arg.name();
+    // legacy_pad is NOTSET (0) or VALID (1) when the convolution does not
+    // pad, SAME (2) and CAFFE_LEGACY_POOLING (3) compute their own padding
+    if (name == "legacy_pad" && arg.i() > 1) {
+      throw std::invalid_argument(
+          "cannot fold input normalization: the convolution pads its input");
+    }
+    if (name != "pad" && name != "pads" && name.compare(0, 4, "pad_") != 0) {
+      continue;
+    }
+    for (const auto v : arg.ints()) {
+      if (v != 0) {
+        throw std::invalid_argument(
+            "cannot fold input normalization: the convolution pads its input");
+      }
+    }
+    if (arg.has_i() && arg.i() != 0) {
+      throw std::invalid_argument(
+          "cannot fold input normalization: the convolution pads its input");
+    }
+  }
+  if (count_readers(*net, conv->input(1)) != 1 ||
+      (conv->input_size() > 2 && count_readers(*net, conv->input(2)) != 1)) {
+    throw std::invalid_argument(
+        "cannot fold input normalization: the convolution weights are shared");
+  }
+  auto weight = get_cpu_float_tensor(ws, conv->input(1));
+  if (weight == nullptr || weight->ndim() < 3) {
+    throw std::invalid_argument(
+        "cannot fold input normalization: the convolution weights are not "
+        "float CPU tensors");
+  }
+
+  const auto order =
+      caffe2::ArgumentHelper::GetSingleArgument<caffe2::OperatorDef,
+                                                std::string>(*conv, "order",
+                                                             "NCHW");
+  const auto group =
+      caffe2::ArgumentHelper::GetSingleArgument<caffe2::OperatorDef, int>(
+          *conv, "group", 1);
+  const int64_t channels = mean.size();
+  const int64_t num_outputs = weight->dim(0);
+  const int64_t group_channels =
+      order == "NCHW" ? weight->dim(1) : weight->dim(weight->ndim() - 1);
+  if (group <= 0 || group_channels * group != channels ||
+      num_outputs % group != 0) {
+    throw std::invalid_argument(
+        "cannot fold input normalization: the number of mean/std values does "
+        "not match the convolution input channels");
+  }
+  auto bias = get_or_create_conv_bias(ws, conv, num_outputs);
+  if (bias == nullptr || bias->size() != num_outputs) {
+    throw std::invalid_argument(
+        "cannot fold input normalization: invalid convolution bias");
+  }
+
+  const auto per_output = weight->size() / num_outputs;
+  const auto kernel_size = per_output / group_channels;
+  const auto outputs_per_group = num_outputs / group;
+  auto w = weight->mutable_data<float>();
+  auto b = bias->mutable_data<float>();
+  for (int64_t oc = 0; oc < num_outputs; oc++) {
+    const auto channel_offset = (oc / outputs_per_group) * group_channels;
+    for (int64_t jj = 0; jj < per_output; jj++) {
+      const auto ic = channel_offset + (order == "NCHW" ? jj / kernel_size
+                                                        : jj % group_channels);
+      auto &v = w[oc * per_output + jj];
+      v /= std[ic];
+      b[oc] -= v * mean[ic];
+    }
+  }
+
+  report->add("fold_input_normalization", op_description(*conv));
+}
+
+// prune_net returns the part of the net that computes target: the
+// operators its value depends on, in their original order, with target as
+// the only external output
+static caffe2::NetDef prune_net(const caffe2::NetDef &net,
+                                const std::string &target) {
+  std::unordered_set<std::string> needed{target};
+  std::vector<int> kept{};
+  for (int ii = net.op_size() - 1; ii >= 0; ii--) {
+    const auto &op = net.op(ii);
+    bool produces_needed = false;
+    for (const auto &out : op.output()) {
+      produces_needed |= needed.count(out) != 0;
+    }
+    if (!produces_needed) {
+      continue;
+    }
+    kept.emplace_back(ii);
+    for (const auto &out : op.output()) {
+      needed.erase(out);
+    }
+    for (const auto &in : op.input()) {
+      needed.insert(in);
+    }
+  }
+  if (kept.empty() && !is_external_input(net, target)) {
+    throw std::invalid_argument("blob " + target +
+                                " is not produced by the net");
+  }
+
+  caffe2::NetDef pruned;
+  pruned.CopyFrom(net);
+  pruned.clear_op();
+  for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+    pruned.add_op(net.op(*it));
+  }
+  pruned.clear_external_input();
+  for (const auto &in : net.external_input()) {
+    if (needed.count(in) != 0) {
+      pruned.add_external_input(in);
+    }
+  }
+  pruned.clear_external_output();
+  pruned.add_external_output(target);
+  pruned.set_name(net.name() + "_to_" + target);
+  return pruned;
+}
+
+// optimize_net rewrites the predict net before it is instantiated. The passes
+// that rewrite parameters only apply to nets whose parameters live on the
+// CPU.
+static void optimize_net(caffe2::NetDef *net, caffe2::Workspace *ws,
+                         const caffe2::DeviceType device_type,
+                         optimization_report *report) {
+  const auto ops_before = net->op_size();
+  remove_noop_operators(net, report);
+  if (device_type == caffe2::CPU) {
+    fold_batch_norm(net, ws, report);
+    fuse_conv_relu(net, report);
+  }
+  report->set_op_counts(ops_before, net->op_size());
+}
+
+}  // namespace mlmodelscope
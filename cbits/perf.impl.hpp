@@ -0,0 +1,183 @@
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// the hardware events counted for the operators, in the order of the
+// counters of perf_sample
+enum perf_event_index {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS = 1,
+  PERF_LLC_MISSES = 2,
+  PERF_BRANCH_MISSES = 3,
+  NUM_PERF_EVENTS = 4,
+};
+
+// perf_sample is a read of the counters of a group, with the times the
+// group was enabled and actually counting, which differ when the kernel
+// multiplexed it with other events
+struct perf_sample {
+  uint64_t counters[NUM_PERF_EVENTS];
+  uint64_t time_enabled{0}, time_running{0};
+};
+
+// perf_delta returns the counts between two reads of a group. When the
+// group was multiplexed in between, the counts are scaled by the share of
+// that interval it was counting, not by the one since it was opened.
+static perf_sample perf_delta(const perf_sample &start,
+                              const perf_sample &stop) {
+  perf_sample delta{};
+  delta.time_enabled = stop.time_enabled - start.time_enabled;
+  delta.time_running = stop.time_running - start.time_running;
+  for (int ii = 0; ii < NUM_PERF_EVENTS; ii++) {
+    auto value = stop.counters[ii] - start.counters[ii];
+    if (delta.time_running != 0 && delta.time_running < delta.time_enabled) {
+      value = static_cast<uint64_t>(static_cast<double>(value) *
+                                    delta.time_enabled / delta.time_running);
+    }
+    delta.counters[ii] = value;
+  }
+  return delta;
+}
+
+// perf_status remembers why the counters could not be opened, so that
+// enabling them fails with a reason instead of silently recording nothing
+class perf_status {
+ public:
+  static perf_status &global() {
+    static perf_status status{};
+    return status;
+  }
+
+  void failed(const std::string &reason) {
+    std::lock_guard<std::mutex> lock(mut_);
+    error_ = reason;
+    failures_++;
+  }
+
+  json to_json() {
+    std::lock_guard<std::mutex> lock(mut_);
+    return json{{"error", error_}, {"open_failures", failures_}};
+  }
+
+ private:
+  std::mutex mut_;
+  std::string error_{""};
+  int64_t failures_{0};
+};
+
+// perf_group is the group of hardware counters of the calling thread. The
+// counters only count user space, which the default perf_event_paranoid
+// setting allows, and are read together with a single system call. When
+// the kernel does not allow them (or they do not exist, as in most virtual
+// machines) the group stays closed and read returns false.
+class perf_group {
+ public:
+  static perf_group &local() {
+    static thread_local perf_group group{};
+    return group;
+  }
+
+  // probe tells whether a group can be opened, with one that is closed
+  // right away. Unlike local it leaves no group open on the calling thread,
+  // which for the C API is any thread the caller happens to run on.
+  static bool probe() {
+    perf_group group{};
+    return group.available();
+  }
+
+  bool available() const { return leader_ >= 0; }
+
+  bool read(perf_sample *sample) {
+#ifdef __linux__
+    if (leader_ < 0) {
+      return false;
+    }
+    // nr, time_enabled, time_running, then a value per event. The values
+    // are the raw counts, perf_delta scales the ones of an interval.
+    uint64_t values[3 + NUM_PERF_EVENTS];
+    if (::read(leader_, values, sizeof(values)) !=
+        static_cast<ssize_t>(sizeof(values))) {
+      return false;
+    }
+    sample->time_enabled = values[1];
+    sample->time_running = values[2];
+    for (int ii = 0; ii < NUM_PERF_EVENTS; ii++) {
+      sample->counters[ii] = values[3 + ii];
+    }
+    return true;
+#else   // __linux__
+    return false;
+#endif  // __linux__
+  }
+
+  ~perf_group() {
+#ifdef __linux__
+    for (const auto fd : fds_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif  // __linux__
+  }
+
+ private:
+  perf_group() {
+#ifdef __linux__
+    const struct {
+      uint32_t type;
+      uint64_t config;
+    } events[NUM_PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    for (int ii = 0; ii < NUM_PERF_EVENTS; ii++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[ii].type;
+      attr.config = events[ii].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      const auto group = ii == 0 ? -1 : fds_[0];
+      fds_[ii] = static_cast<int>(
+          syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+      if (fds_[ii] < 0) {
+        perf_status::global().failed(std::string("perf_event_open: ") +
+                                     strerror(errno));
+        return;
+      }
+    }
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    leader_ = fds_[0];
+#else   // __linux__
+    perf_status::global().failed("perf events are only supported on linux");
+#endif  // __linux__
+  }
+
+  int fds_[NUM_PERF_EVENTS] = {-1, -1, -1, -1};
+  int leader_{-1};
+};
+
+}  // namespace mlmodelscope
@@ -11,12 +11,76 @@ extern "C" {
 
 typedef void *PredictorContext;
 
+typedef void *ModelRegistryContext;
+
+typedef void *CancelTokenContext;
+
 typedef enum { CPU_DEVICE_KIND = 0, CUDA_DEVICE_KIND = 1 } DeviceKind;
 
+// Runs of low priority predictors are paused between operators while runs
+// of high priority predictors are in progress anywhere in the process
+typedef enum {
+  NORMAL_PRIORITY = 0,
+  LOW_PRIORITY = 1,
+  HIGH_PRIORITY = 2
+} Priority;
+
+typedef struct {
+  // apply the load time graph optimizations to the predict net
+  int optimize_graph;
+  // per channel input normalization folded into the first convolution,
+  // input_mean is NULL when disabled and input_std may be NULL. Both hold
+  // input_channels values, which must be the input channels of the
+  // convolution.
+  const float *input_mean;
+  const float *input_std;
+  int input_channels;
+  // intra-op threads used by the caffe2 pool, OpenMP and BLAS, 0 keeps the
+  // library defaults
+  int num_threads;
+  // cpus the predictor threads are pinned to, NULL to not pin them
+  const int *cpus;
+  int num_cpus;
+  // numa node the predictor memory and threads are bound to, -1 to not bind
+  int numa_node;
+  // back large parameter and activation tensors with pre-faulted 2MB pages,
+  // and lock them in memory when lock_memory is set
+  int huge_pages;
+  int lock_memory;
+  Priority priority;
+  // share of the executor workers relative to the predictors of the same
+  // priority, 0 counts as 1
+  int weight;
+} PredictorOptions;
+
+PredictorOptions DefaultPredictorOptionsCaffe2();
+
+typedef struct {
+  // bytes of the parameter and activation tensors at their current shape
+  int64_t parameter_bytes;
+  int64_t activation_bytes;
+  // peak of the CPU memory allocated by the predictor during the last run,
+  // and the amount currently allocated
+  int64_t peak_bytes;
+  int64_t allocated_bytes;
+  // bytes of the output buffer returned by GetPredictionsCaffe2
+  int64_t output_bytes;
+} MemoryUsage;
+
+// The constructors return NULL when the predictor cannot be created, with
+// the reason in *error (when error is not NULL), which the caller frees.
 PredictorContext NewCaffe2(char *init_net_file, char *net_file,
-                           DeviceKind device);
+                           DeviceKind device, const PredictorOptions *options,
+                           char **error);
 PredictorContext NewCaffe2FromOnnx(char *onnx_data, int64_t onnx_data_len,
-                                   DeviceKind device);
+                                   DeviceKind device,
+                                   const PredictorOptions *options,
+                                   char **error);
+// spill_file is written by SpillCaffe2, the graph rewrites of the options
+// are ignored since the spilled net already went through them
+PredictorContext NewCaffe2FromSpill(const char *spill_file, DeviceKind device,
+                                    const PredictorOptions *options,
+                                    char **error);
 
 void InitCaffe2(DeviceKind device_kind);
 
@@ -24,6 +88,114 @@ error_t PredictCaffe2(PredictorContext pred, float *imageData,
                       const char *input_type, const int batch,
                       const int channels, const int width, const int height);
 
+// PredictPartialCaffe2 only runs the operators output_blob depends on, and
+// returns its value (read with GetPredictionsCaffe2) instead of the net
+// output. The pruned net is built on first use and cached.
+error_t PredictPartialCaffe2(PredictorContext pred, float *imageData,
+                             const char *output_blob, const int batch,
+                             const int channels, const int width,
+                             const int height);
+
+// PredictWithDeadlineCaffe2 stops the prediction between operators once
+// timeout_us microseconds have elapsed (0 for no deadline) or the token,
+// which may be NULL, is cancelled. It then returns error_deadline_exceeded
+// or error_cancelled.
+error_t PredictWithDeadlineCaffe2(PredictorContext pred, float *imageData,
+                                  const char *input_type, const int batch,
+                                  const int channels, const int width,
+                                  const int height, const int64_t timeout_us,
+                                  CancelTokenContext token);
+
+typedef struct {
+  // shape of the input
+  int batch_size;
+  int channels;
+  int width;
+  int height;
+  // deadline and cancellation, as in PredictWithDeadlineCaffe2
+  int64_t timeout_us;
+  CancelTokenContext token;
+  // return the profile of the run in the response
+  int profile;
+  // capacity of the output destination in floats
+  int64_t output_capacity;
+  // blob to return instead of the net output, as in PredictPartialCaffe2,
+  // NULL for the net output
+  const char *output_blob;
+} PredictRequest;
+
+typedef struct {
+  // status of the prediction, also returned by PredictFusedCaffe2
+  error_t status;
+  // the output is output_size floats, written to the output destination
+  // when it was large enough, and otherwise left in the predictor buffer
+  // pointed to by output (NULL in the former case)
+  float *output;
+  int64_t output_size;
+  int pred_len;
+  // JSON profile of the run when requested, to be freed by the caller
+  char *profile;
+} PredictResponse;
+
+// PredictFusedCaffe2 runs a prediction and returns its output and profile
+// in a single call. The input holds batch_size * channels * width * height
+// floats and is read in place. output may be NULL.
+error_t PredictFusedCaffe2(PredictorContext pred, float *input, float *output,
+                           const PredictRequest *request,
+                           PredictResponse *response);
+
+// A session keeps the recurrent state of a sequence model between
+// predictions. After each step, the state_outputs blobs are copied to the
+// state_inputs blobs, which start from their value in the model workspace.
+// Sessions unused for ttl_ms (when positive) are deleted. NewSessionCaffe2
+// returns -1 on error.
+int64_t NewSessionCaffe2(PredictorContext pred, const char **state_inputs,
+                         const char **state_outputs, const int num_states,
+                         const int64_t ttl_ms);
+
+// PredictSessionCaffe2 runs a step of the session, the output is read with
+// GetSessionPredictionsCaffe2. Steps of different sessions may run
+// concurrently.
+error_t PredictSessionCaffe2(PredictorContext pred, const int64_t session,
+                             float *imageData, const int batch,
+                             const int channels, const int width,
+                             const int height);
+
+// GetSessionPredictionsCaffe2 returns the output of the last step of the
+// session, which stays valid until its next step, and sets pred_len to the
+// output length per batch element
+float *GetSessionPredictionsCaffe2(PredictorContext pred,
+                                   const int64_t session, int *pred_len);
+
+error_t DeleteSessionCaffe2(PredictorContext pred, const int64_t session);
+
+char *ReadSessionsCaffe2(PredictorContext pred);
+
+// A cancel token may be cancelled from any thread, before or during the
+// prediction it is passed to
+CancelTokenContext NewCancelTokenCaffe2();
+
+void CancelCaffe2(CancelTokenContext token);
+
+void DeleteCancelTokenCaffe2(CancelTokenContext token);
+
+// shapes holds num_shapes (batch, channels, width, height) tuples and
+// latencies must have room for num_shapes * iterations entries
+error_t WarmupCaffe2(PredictorContext pred, const int iterations,
+                     const int *shapes, const int num_shapes,
+                     double *latencies);
+
+// SwapWeightsCaffe2 loads the parameters of init_net_file next to the live
+// ones, applies the load time rewrites and runs the warmup of
+// WarmupCaffe2 (skipped when iterations or num_shapes is 0) before making
+// them live. Predictions that already started finish on the previous
+// parameters. latencies may be NULL. It fails with error_invalid_argument
+// on a predictor created by NewCaffe2FromSpill, whose net was rewritten
+// for the weights it was spilled with.
+error_t SwapWeightsCaffe2(PredictorContext pred, char *init_net_file,
+                          const int iterations, const int *shapes,
+                          const int num_shapes, double *latencies);
+
 float *GetPredictionsCaffe2(PredictorContext pred);
 
 void DeleteCaffe2(PredictorContext pred);
@@ -37,8 +209,131 @@ void DisableProfilingCaffe2(PredictorContext pred);
 
 char *ReadProfileCaffe2(PredictorContext pred);
 
+// ReadProfileBinaryCaffe2 encodes the profile in the compact binary format
+// of profile::write_binary into buffer and returns the size of the
+// encoding. When the size exceeds capacity the contents of the buffer are
+// unspecified (a part of the encoding may have been written), and the
+// caller retries with a buffer of the returned size. It returns 0 when
+// there is no profile and -1 on error.
+int64_t ReadProfileBinaryCaffe2(PredictorContext pred, char *buffer,
+                                int64_t capacity);
+
+// ReadProfileTraceCaffe2 returns the profile in the Chrome Trace Event
+// format, which chrome://tracing and Perfetto open
+char *ReadProfileTraceCaffe2(PredictorContext pred);
+
+// StartSampledProfilingCaffe2 profiles one in every `every` predictions
+// (none when 0) and the predictions slower than threshold_us (none when 0)
+// and keeps the last `keep` of these profiles. When a threshold is set
+// every prediction is recorded, but only the kept ones are serialized.
+// Predictions that are profiled anyway are not sampled.
+error_t StartSampledProfilingCaffe2(PredictorContext pred, int64_t every,
+                                    int64_t threshold_us, int keep);
+
+void EndSampledProfilingCaffe2(PredictorContext pred);
+
+void ClearSampledProfilesCaffe2(PredictorContext pred);
+
+char *ReadSampledProfilesCaffe2(PredictorContext pred);
+
+// StartHistogramsCaffe2 adds the latency of every run of the predictor,
+// and of each of its operators, to log-bucketed histograms until
+// EndHistogramsCaffe2 is called. The runs do not need to be profiled.
+void StartHistogramsCaffe2(PredictorContext pred);
+
+void EndHistogramsCaffe2(PredictorContext pred);
+
+void ResetHistogramsCaffe2(PredictorContext pred);
+
+char *ReadHistogramsCaffe2(PredictorContext pred);
+
+// MeasureMachinePeakCaffe2 measures the floating point throughput and the
+// memory bandwidth of the machine on num_threads threads (all the cores
+// when num_threads is 0). It takes around a second. The last measure is
+// added to the profiles, for roofline comparisons of their operators.
+char *MeasureMachinePeakCaffe2(int num_threads);
+
+// EnablePerfCountersCaffe2 makes the profiled operator runs read the
+// hardware counters of their thread (cycles, instructions, last level
+// cache misses and branch misses). It returns error_not_implemented when
+// the kernel does not allow the counters. Threads that cannot open them
+// record their operators without counters.
+error_t EnablePerfCountersCaffe2(PredictorContext pred, int enable);
+
+// ReadPerfCountersStatusCaffe2 tells whether the calling thread can read
+// the hardware counters, and why the last attempt to open them failed
+char *ReadPerfCountersStatusCaffe2();
+
+// SetClockCaffe2 selects the clock of the profiles of the process. It
+// returns error_not_implemented when the clock is not available, and must
+// be called while no profile is being recorded.
+error_t SetClockCaffe2(ClockKind kind);
+
+char *ReadClockCaffe2();
+
+char *ReadOptimizationReportCaffe2(PredictorContext pred);
+
+char *ReadThreadingCaffe2(PredictorContext pred);
+
+char *ReadNumaCaffe2(PredictorContext pred);
+
+char *ReadArenaCaffe2(PredictorContext pred);
+
+char *ReadPreemptionCaffe2(PredictorContext pred);
+
+// MeasureObserverOverheadCaffe2 runs the net iterations times with its
+// profiling observers attached but idle, and as many times without them,
+// on a synthetic input of the given shape, and reports the median latencies
+// and the cost of the observers per operator
+char *MeasureObserverOverheadCaffe2(PredictorContext pred,
+                                    const int iterations, const int batch,
+                                    const int channels, const int width,
+                                    const int height);
+
+// StartExecutorCaffe2 starts the process wide executor. From then on the
+// predictions of every predictor are queued and run by its num_workers
+// threads, high priority predictors first and, within a priority, in
+// proportion to the predictor weights.
+error_t StartExecutorCaffe2(const int num_workers);
+
+// ReadExecutorCaffe2 returns the executor state along with the queueing
+// metrics of pred, which may be NULL
+char *ReadExecutorCaffe2(PredictorContext pred);
+
+error_t GetMemoryUsageCaffe2(PredictorContext pred, MemoryUsage *usage);
+
 int GetPredLenCaffe2(PredictorContext pred);
 
+// SpillCaffe2 writes the rewritten predict net and the parameters of the
+// predictor to spill_file
+error_t SpillCaffe2(PredictorContext pred, const char *spill_file);
+
+// A model registry creates the predictors of its models on demand and
+// deletes the least recently used idle ones when the loaded models exceed
+// memory_budget bytes (0 for no budget). Evicted models are spilled to
+// spill_dir, when it is not NULL, to be reloaded from there.
+ModelRegistryContext NewModelRegistryCaffe2(int64_t memory_budget,
+                                            const char *spill_dir);
+
+error_t RegisterModelCaffe2(ModelRegistryContext registry, const char *id,
+                            const char *init_net_file, const char *net_file,
+                            DeviceKind device,
+                            const PredictorOptions *options);
+
+// AcquireModelCaffe2 returns the predictor of a model, which is owned by
+// the registry and must be handed back with ReleaseModelCaffe2. A model has
+// one holder at a time, the call blocks until the previous one released it.
+PredictorContext AcquireModelCaffe2(ModelRegistryContext registry,
+                                    const char *id);
+
+error_t ReleaseModelCaffe2(ModelRegistryContext registry, const char *id);
+
+char *ReadModelRegistryCaffe2(ModelRegistryContext registry);
+
+// DeleteModelRegistryCaffe2 waits for the acquired predictors to be
+// released, then deletes the registry and its predictors
+void DeleteModelRegistryCaffe2(ModelRegistryContext registry);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
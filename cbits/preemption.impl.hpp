@@ -0,0 +1,74 @@
+#ifndef __PREEMPTION_IMPL_HPP__
+#define __PREEMPTION_IMPL_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace mlmodelscope {
+
+// preemption_gate is shared by the predictors of the process. While a high
+// priority run is in progress, the low priority runs wait at their next
+// operator boundary, which leaves the cores to the high priority run, and
+// resume once no high priority run is left.
+class preemption_gate {
+ public:
+  static preemption_gate &global() {
+    static preemption_gate gate;
+    return gate;
+  }
+
+  void enter() {
+    std::lock_guard<std::mutex> lock(mut_);
+    active_++;
+  }
+
+  void exit() {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (--active_ == 0) {
+      idle_.notify_all();
+    }
+  }
+
+  bool busy() const { return active_.load(std::memory_order_acquire) > 0; }
+
+  // wait blocks until no high priority run is in progress or the timeout
+  // elapses, and returns whether the gate is still busy
+  bool wait(std::chrono::microseconds timeout) {
+    std::unique_lock<std::mutex> lock(mut_);
+    idle_.wait_for(lock, timeout, [this] { return active_ == 0; });
+    return active_ > 0;
+  }
+
+  int active() const { return active_; }
+
+ private:
+  std::mutex mut_;
+  std::condition_variable idle_;
+  std::atomic<int> active_{0};
+};
+
+// preemption_scope marks a high priority run for the duration of the scope
+class preemption_scope {
+ public:
+  explicit preemption_scope(bool high_priority)
+      : high_priority_(high_priority) {
+    if (high_priority_) {
+      preemption_gate::global().enter();
+    }
+  }
+  ~preemption_scope() {
+    if (high_priority_) {
+      preemption_gate::global().exit();
+    }
+  }
+
+ private:
+  bool high_priority_;
+};
+
+}  // namespace mlmodelscope
+
+#endif  // __PREEMPTION_IMPL_HPP__
@@ -0,0 +1,372 @@
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "json.hpp"
+#include "predictor.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// model_registry loads the predictors of the registered models on demand
+// and keeps the ones that are loaded within a memory budget by evicting the
+// least recently used idle models. Evicted models are optionally spilled
+// to a directory, in the format read by NewCaffe2FromSpill, so that
+// reloading them skips the init net and the graph optimizations.
+//
+// Predictors are not safe to run concurrently, so a model has at most one
+// holder at a time: acquire waits until the previous holder released it.
+class model_registry {
+ public:
+  model_registry(int64_t memory_budget, std::string spill_dir)
+      : memory_budget_(memory_budget), spill_dir_(spill_dir) {}
+
+  // the registry waits for the predictors in use to be released before
+  // deleting them, and removes the spills of its models
+  ~model_registry() {
+    std::unique_lock<std::mutex> lock(mut_);
+    closing_ = true;
+    changed_.wait(lock, [this] {
+      for (const auto &kv : models_) {
+        if (kv.second.refs > 0 || kv.second.loading || kv.second.evicting) {
+          return false;
+        }
+      }
+      return true;
+    });
+    for (auto &kv : models_) {
+      if (kv.second.pred != nullptr) {
+        DeleteCaffe2(kv.second.pred);
+      }
+      remove_spill(&kv.second);
+    }
+  }
+
+  void add(std::string id, std::string init_net_file,
+           std::string pred_net_file, DeviceKind device,
+           const PredictorOptions &options) {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (models_.count(id) != 0) {
+      throw std::invalid_argument("model " + id + " is already registered");
+    }
+    if ((options.input_mean != nullptr || options.input_std != nullptr) &&
+        options.input_channels <= 0) {
+      throw std::invalid_argument(
+          "the input normalization needs a positive number of channels");
+    }
+    auto &m = models_[id];
+    m.init_net_file = init_net_file;
+    m.pred_net_file = pred_net_file;
+    m.device = device;
+    m.options = options;
+    // the options are used after the caller is gone, keep our own copies
+    if (options.input_mean != nullptr) {
+      m.input_mean.assign(options.input_mean,
+                          options.input_mean + options.input_channels);
+      m.options.input_mean = m.input_mean.data();
+    }
+    if (options.input_std != nullptr) {
+      m.input_std.assign(options.input_std,
+                         options.input_std + options.input_channels);
+      m.options.input_std = m.input_std.data();
+    }
+    if (options.cpus != nullptr) {
+      m.cpus.assign(options.cpus, options.cpus + options.num_cpus);
+      m.options.cpus = m.cpus.data();
+    }
+  }
+
+  // acquire returns the predictor of the model, loading it when needed. It
+  // waits while another holder has the predictor, which is not evicted
+  // until it is released.
+  PredictorContext acquire(const std::string &id) {
+    std::unique_lock<std::mutex> lock(mut_);
+    auto it = models_.find(id);
+    if (it == models_.end()) {
+      throw std::invalid_argument("model " + id + " is not registered");
+    }
+    auto &m = it->second;
+    while (m.loading || m.evicting || m.refs > 0) {
+      changed_.wait(lock);
+    }
+    if (closing_) {
+      throw std::runtime_error("the registry is closed");
+    }
+    if (m.pred != nullptr) {
+      hits_++;
+      m.refs++;
+      touch(id, m);
+      return m.pred;
+    }
+
+    misses_++;
+    m.loading = true;
+    lock.unlock();
+    PredictorContext pred = nullptr;
+    bool from_spill = false;
+    std::string error{""};
+    try {
+      pred = load(m, &from_spill, &error);
+    } catch (...) {
+      lock.lock();
+      m.loading = false;
+      changed_.notify_all();
+      throw;
+    }
+    lock.lock();
+    m.loading = false;
+    if (pred == nullptr) {
+      load_failures_++;
+      changed_.notify_all();
+      throw std::runtime_error("unable to load model " + id + ": " + error);
+    }
+    spill_loads_ += from_spill ? 1 : 0;
+    m.pred = pred;
+    m.refs++;
+    m.bytes = footprint(pred);
+    used_bytes_ += m.bytes;
+    touch(id, m);
+    const auto victims = evict();
+    lock.unlock();
+    unload(victims);
+    return pred;
+  }
+
+  // release returns a predictor obtained by acquire to the registry, which
+  // hands it to the next acquirer. Its footprint is refreshed since its
+  // activations were sized by the runs it served.
+  void release(const std::string &id) {
+    std::unique_lock<std::mutex> lock(mut_);
+    auto it = models_.find(id);
+    if (it == models_.end() || it->second.refs == 0) {
+      throw std::invalid_argument("model " + id + " is not acquired");
+    }
+    auto &m = it->second;
+    m.refs--;
+    const auto bytes = footprint(m.pred);
+    used_bytes_ += bytes - m.bytes;
+    m.bytes = bytes;
+    const auto victims = evict();
+    changed_.notify_all();
+    lock.unlock();
+    unload(victims);
+  }
+
+  json to_json() {
+    std::lock_guard<std::mutex> lock(mut_);
+    int64_t loaded = 0, in_use = 0;
+    for (const auto &kv : models_) {
+      loaded += kv.second.pred != nullptr ? 1 : 0;
+      in_use += kv.second.refs > 0 ? 1 : 0;
+    }
+    return json{
+        {"models", models_.size()},
+        {"loaded", loaded},
+        {"in_use", in_use},
+        {"memory_budget", memory_budget_},
+        {"used_bytes", used_bytes_},
+        {"hits", hits_},
+        {"misses", misses_},
+        {"evictions", evictions_},
+        {"spills", spills_},
+        {"spill_loads", spill_loads_},
+        {"load_failures", load_failures_},
+        {"over_budget", over_budget_},
+    };
+  }
+
+ private:
+  struct model {
+    std::string init_net_file, pred_net_file;
+    DeviceKind device;
+    PredictorOptions options;
+    std::vector<float> input_mean, input_std;
+    std::vector<int> cpus;
+
+    PredictorContext pred{nullptr};
+    bool loading{false};
+    // while the evicted predictor is spilled and deleted
+    bool evicting{false};
+    // 1 while a holder has the predictor
+    int refs{0};
+    int64_t bytes{0};
+    // the spill of the model and its file identity when it was written
+    std::string spill_file{""};
+    dev_t spill_dev{0};
+    ino_t spill_ino{0};
+    bool in_lru{false};
+    std::list<std::string>::iterator lru;
+  };
+
+  static int64_t footprint(PredictorContext pred) {
+    MemoryUsage usage;
+    if (GetMemoryUsageCaffe2(pred, &usage) != success) {
+      return 0;
+    }
+    return std::max(usage.parameter_bytes + usage.activation_bytes,
+                    usage.allocated_bytes) +
+           usage.output_bytes;
+  }
+
+  // load creates the predictor of the model, from its spill when it has
+  // one. The spill is removed once read, the model is spilled again when
+  // it is evicted again. The reason the predictor could not be created is
+  // returned in error.
+  PredictorContext load(model &m, bool *from_spill, std::string *error) {
+    if (owns_spill(m)) {
+      auto pred = NewCaffe2FromSpill(m.spill_file.c_str(), m.device,
+                                     &m.options, nullptr);
+      remove_spill(&m);
+      if (pred != nullptr) {
+        *from_spill = true;
+        return pred;
+      }
+    }
+    char *reason = nullptr;
+    auto pred = NewCaffe2(const_cast<char *>(m.init_net_file.c_str()),
+                          const_cast<char *>(m.pred_net_file.c_str()),
+                          m.device, &m.options, &reason);
+    if (reason != nullptr) {
+      *error = reason;
+      free(reason);
+    }
+    return pred;
+  }
+
+  void touch(const std::string &id, model &m) {
+    if (m.in_lru) {
+      lru_.erase(m.lru);
+    }
+    lru_.push_front(id);
+    m.lru = lru_.begin();
+    m.in_lru = true;
+  }
+
+  struct victim {
+    std::string id;
+    PredictorContext pred;
+  };
+
+  // evict takes idle models out of the loaded ones, least recently used
+  // first, until the loaded models fit in the budget. It is called with
+  // the lock held, the predictors it returns are spilled and deleted by
+  // unload once the lock is released.
+  std::vector<victim> evict() {
+    std::vector<victim> victims{};
+    if (memory_budget_ <= 0) {
+      return victims;
+    }
+    auto it = lru_.end();
+    while (used_bytes_ > memory_budget_ && it != lru_.begin()) {
+      --it;
+      auto &m = models_[*it];
+      if (m.refs > 0 || m.pred == nullptr) {
+        continue;
+      }
+      victims.push_back(victim{*it, m.pred});
+      m.pred = nullptr;
+      m.evicting = true;
+      used_bytes_ -= m.bytes;
+      m.bytes = 0;
+      m.in_lru = false;
+      it = lru_.erase(it);
+      evictions_++;
+    }
+    if (used_bytes_ > memory_budget_) {
+      over_budget_++;
+    }
+    return victims;
+  }
+
+  // unload spills and deletes the predictors taken out by evict. Their
+  // models stay evicting, which holds off their acquirers, meanwhile.
+  void unload(const std::vector<victim> &victims) {
+    for (const auto &v : victims) {
+      std::string spill_file{""};
+      struct stat st;
+      if (!spill_dir_.empty()) {
+        spill_file = spill_dir_ + "/" + spill_name(v.id) + ".c2spill";
+        if (SpillCaffe2(v.pred, spill_file.c_str()) != success ||
+            stat(spill_file.c_str(), &st) != 0) {
+          spill_file.clear();
+        }
+      }
+      DeleteCaffe2(v.pred);
+
+      std::lock_guard<std::mutex> lock(mut_);
+      auto &m = models_[v.id];
+      if (!spill_file.empty()) {
+        m.spill_file = spill_file;
+        m.spill_dev = st.st_dev;
+        m.spill_ino = st.st_ino;
+        spills_++;
+      }
+      m.evicting = false;
+      changed_.notify_all();
+    }
+  }
+
+  // spill_name escapes the characters of the id that are not safe in a
+  // file name as %XX, which keeps the names of different ids different
+  static std::string spill_name(const std::string &id) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string name{""};
+    for (const auto c : id) {
+      const auto u = static_cast<unsigned char>(c);
+      if (isalnum(u) || c == '-' || c == '_') {
+        name += c;
+      } else {
+        name += '%';
+        name += hex[u >> 4];
+        name += hex[u & 0xf];
+      }
+    }
+    return name;
+  }
+
+  // owns_spill tells whether the spill file of the model is still the one
+  // it was evicted to. Spills are renamed into place, so a file written
+  // since, by another registry sharing the directory, is another inode.
+  static bool owns_spill(const model &m) {
+    struct stat st;
+    return !m.spill_file.empty() && stat(m.spill_file.c_str(), &st) == 0 &&
+           st.st_dev == m.spill_dev && st.st_ino == m.spill_ino;
+  }
+
+  // remove_spill deletes the spill file of the model, unless another
+  // registry replaced it
+  static void remove_spill(model *m) {
+    if (owns_spill(*m)) {
+      unlink(m->spill_file.c_str());
+    }
+    m->spill_file.clear();
+  }
+
+  int64_t memory_budget_{0};
+  std::string spill_dir_{""};
+  std::mutex mut_;
+  // notified when a model is loaded or released
+  std::condition_variable changed_;
+  bool closing_{false};
+  std::unordered_map<std::string, model> models_{};
+  // ids of the loaded models, most recently used first
+  std::list<std::string> lru_{};
+  int64_t used_bytes_{0};
+  int64_t hits_{0}, misses_{0}, evictions_{0}, spills_{0}, spill_loads_{0},
+      load_failures_{0}, over_budget_{0};
+};
+
+}  // namespace mlmodelscope
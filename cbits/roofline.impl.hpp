@@ -0,0 +1,364 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <caffe2/proto/caffe2.pb.h>
+#include <caffe2/utils/proto_utils.h>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace mlmodelscope {
+
+// op_cost is the work of an operator run: the floating point operations it
+// performs (a multiply-add counts as two) and the bytes it reads and
+// writes, assuming each tensor goes through memory once
+struct op_cost {
+  double flops{0};
+  double bytes{0};
+  // whether the operator is known to the estimator
+  bool estimated{false};
+};
+
+static const double float_bytes = 4;
+
+static int64_t num_elements(const std::vector<int> &shape) {
+  int64_t n = 1;
+  for (const auto d : shape) {
+    n *= d;
+  }
+  return n;
+}
+
+static int op_arg(const caffe2::OperatorDef &op, const std::string &name,
+                  int default_value) {
+  return caffe2::ArgumentHelper::GetSingleArgument<caffe2::OperatorDef, int>(
+      op, name, default_value);
+}
+
+// spatial_arg resolves the 2D arguments of the convolutions and poolings,
+// which are given as name_h and name_w, as the repeated names, or as a
+// single name for both dimensions
+static void spatial_arg(const caffe2::OperatorDef &op, const std::string &name,
+                        int default_value, int *h, int *w) {
+  const auto all = op_arg(op, name, default_value);
+  *h = op_arg(op, name + "_h", all);
+  *w = op_arg(op, name + "_w", all);
+  const auto repeated =
+      caffe2::ArgumentHelper::GetRepeatedArgument<caffe2::OperatorDef, int>(
+          op, name + "s");
+  if (repeated.size() == 2) {
+    *h = repeated[0];
+    *w = repeated[1];
+  }
+}
+
+// output_size is the spatial output size of a window of `kernel` elements
+// sliding over `size` elements
+static int64_t output_size(int64_t size, int kernel, int stride, int pad_begin,
+                           int pad_end, int dilation) {
+  const auto extent = static_cast<int64_t>(dilation) * (kernel - 1) + 1;
+  return std::max<int64_t>(
+      0, (size + pad_begin + pad_end - extent) / std::max(stride, 1) + 1);
+}
+
+// window_output computes the output height and width of a convolution or a
+// pooling with a kernel_h x kernel_w window over an input of height x width
+static void window_output(const caffe2::OperatorDef &op, int64_t height,
+                          int64_t width, int kernel_h, int kernel_w,
+                          int64_t *out_h, int64_t *out_w) {
+  int stride_h = 1, stride_w = 1, dilation_h = 1, dilation_w = 1;
+  spatial_arg(op, "stride", 1, &stride_h, &stride_w);
+  spatial_arg(op, "dilation", 1, &dilation_h, &dilation_w);
+  const auto pad = op_arg(op, "pad", 0);
+  int pad_t = op_arg(op, "pad_t", pad), pad_l = op_arg(op, "pad_l", pad),
+      pad_b = op_arg(op, "pad_b", pad), pad_r = op_arg(op, "pad_r", pad);
+  const auto pads =
+      caffe2::ArgumentHelper::GetRepeatedArgument<caffe2::OperatorDef, int>(
+          op, "pads");
+  if (pads.size() == 4) {
+    pad_t = pads[0];
+    pad_l = pads[1];
+    pad_b = pads[2];
+    pad_r = pads[3];
+  }
+  *out_h = output_size(height, kernel_h, stride_h, pad_t, pad_b, dilation_h);
+  *out_w = output_size(width, kernel_w, stride_w, pad_l, pad_r, dilation_w);
+}
+
+// estimate_op_cost derives the work of an operator run from its type, its
+// arguments and the shapes of its inputs. Operators the estimator does not
+// know are returned with estimated set to false.
+static op_cost estimate_op_cost(const caffe2::OperatorDef &op,
+                                const std::vector<std::vector<int>> &inputs) {
+  op_cost cost{};
+  if (inputs.empty() || inputs[0].empty()) {
+    return cost;
+  }
+  const auto &type = op.type();
+  const auto &x = inputs[0];
+  const auto x_size = num_elements(x);
+  int64_t inputs_size = 0;
+  for (const auto &shape : inputs) {
+    inputs_size += num_elements(shape);
+  }
+  const auto order = caffe2::ArgumentHelper::GetSingleArgument<
+      caffe2::OperatorDef, std::string>(op, "order", "NCHW");
+  const bool nhwc = order == "NHWC";
+
+  if ((type == "Conv" || type == "ConvRelu") && x.size() == 4 &&
+      inputs.size() >= 2 && inputs[1].size() == 4) {
+    const auto &filter = inputs[1];
+    const int64_t n = x[0], height = nhwc ? x[1] : x[2],
+                  width = nhwc ? x[2] : x[3];
+    const int64_t m = filter[0];
+    const int kernel_h = nhwc ? filter[1] : filter[2];
+    const int kernel_w = nhwc ? filter[2] : filter[3];
+    const int64_t channels_per_group = nhwc ? filter[3] : filter[1];
+    int64_t out_h = 0, out_w = 0;
+    window_output(op, height, width, kernel_h, kernel_w, &out_h, &out_w);
+    const auto output = n * m * out_h * out_w;
+    cost.flops = 2.0 * output * channels_per_group * kernel_h * kernel_w;
+    if (inputs.size() >= 3) {
+      cost.flops += output;
+    }
+    if (type == "ConvRelu") {
+      cost.flops += output;
+    }
+    cost.bytes = float_bytes * (inputs_size + output);
+    cost.estimated = true;
+  } else if (type == "FC" && inputs.size() >= 2 && inputs[1].size() >= 2) {
+    const auto axis = std::min<size_t>(op_arg(op, "axis", 1), x.size());
+    int64_t m = 1;
+    for (size_t ii = 0; ii < axis; ii++) {
+      m *= x[ii];
+    }
+    const int64_t k = x_size / std::max<int64_t>(m, 1);
+    const int64_t n = inputs[1][0];
+    cost.flops = 2.0 * m * k * n + (inputs.size() >= 3 ? m * n : 0);
+    cost.bytes = float_bytes * (inputs_size + m * n);
+    cost.estimated = true;
+  } else if ((type == "MaxPool" || type == "AveragePool") && x.size() == 4) {
+    const int64_t n = x[0], channels = nhwc ? x[3] : x[1],
+                  height = nhwc ? x[1] : x[2], width = nhwc ? x[2] : x[3];
+    int kernel_h = 1, kernel_w = 1;
+    spatial_arg(op, "kernel", 1, &kernel_h, &kernel_w);
+    int64_t out_h = 1, out_w = 1;
+    if (op_arg(op, "global_pooling", 0) != 0) {
+      kernel_h = height;
+      kernel_w = width;
+    } else {
+      window_output(op, height, width, kernel_h, kernel_w, &out_h, &out_w);
+    }
+    const auto output = n * channels * out_h * out_w;
+    cost.flops = static_cast<double>(output) * kernel_h * kernel_w;
+    cost.bytes = float_bytes * (x_size + output);
+    cost.estimated = true;
+  } else if (type == "Relu" || type == "Sigmoid" || type == "Tanh" ||
+             type == "Exp" || type == "Abs" || type == "Neg" ||
+             type == "Sqrt" || type == "Clip" || type == "LeakyRelu" ||
+             type == "Scale") {
+    cost.flops = x_size;
+    cost.bytes = float_bytes * 2 * x_size;
+    cost.estimated = true;
+  } else if (type == "Add" || type == "Sub" || type == "Mul" ||
+             type == "Div" || type == "Sum" || type == "Max" ||
+             type == "Min") {
+    // the inputs after the first may be broadcast, the output has the size
+    // of the largest input
+    int64_t output = 0;
+    for (const auto &shape : inputs) {
+      output = std::max(output, num_elements(shape));
+    }
+    cost.flops = static_cast<double>(output) * (inputs.size() - 1);
+    cost.bytes = float_bytes * (inputs_size + output);
+    cost.estimated = true;
+  } else if (type == "SpatialBN" || type == "Softmax" || type == "LRN") {
+    // batch norm at test time is a scale and a shift per element, softmax
+    // an exponential, a sum and a division, and the local response
+    // normalization a sum of squares over its window
+    double per_element = 2;
+    if (type == "Softmax") {
+      per_element = 5;
+    } else if (type == "LRN") {
+      per_element = 2.0 * op_arg(op, "size", 5) + 3;
+    }
+    cost.flops = per_element * x_size;
+    cost.bytes = float_bytes * (inputs_size + x_size);
+    cost.estimated = true;
+  } else if (type == "Concat" || type == "Copy" || type == "Transpose" ||
+             type == "Flatten" || type == "Reshape" || type == "Dropout" ||
+             type == "Split" || type == "Slice") {
+    cost.bytes = float_bytes * 2 * x_size;
+    if (type == "Concat") {
+      cost.bytes = float_bytes * 2 * inputs_size;
+    }
+    cost.estimated = true;
+  }
+  return cost;
+}
+
+// machine_peak is the roofline of the machine: the floating point
+// throughput and the memory bandwidth measured by micro-benchmarks run on
+// a number of threads
+struct machine_peak {
+  int threads{0};
+  double gflops{0};
+  double gbps{0};
+
+  json to_json() const {
+    return json{
+        {"threads", threads},
+        {"peak_gflops", gflops},
+        {"peak_gbps", gbps},
+        // the arithmetic intensity above which operators are compute bound
+        {"ridge_flops_per_byte", gbps == 0 ? 0.0 : gflops / gbps},
+    };
+  }
+};
+
+// flops_kernel runs chains of independent multiply-adds that the compiler
+// can keep in vector registers, and returns the flops performed
+static double flops_kernel(int64_t iterations) {
+  const int lanes = 64;
+  float acc[lanes];
+  for (int ii = 0; ii < lanes; ii++) {
+    acc[ii] = static_cast<float>(ii);
+  }
+  const float a = 0.999999f, b = 1.0e-7f;
+  for (int64_t it = 0; it < iterations; it++) {
+    for (int ii = 0; ii < lanes; ii++) {
+      acc[ii] = acc[ii] * a + b;
+    }
+  }
+  // keep the results alive
+  volatile float sink = 0;
+  for (int ii = 0; ii < lanes; ii++) {
+    sink = sink + acc[ii];
+  }
+  return 2.0 * lanes * iterations;
+}
+
+// last_level_cache_bytes is the size of the last level cache, 32MB when the
+// C library does not tell
+static size_t last_level_cache_bytes() {
+  long bytes = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (bytes <= 0) {
+    bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  }
+#endif
+  return bytes > 0 ? static_cast<size_t>(bytes) : size_t(32) << 20;
+}
+
+// bandwidth_kernel runs the STREAM triad over arrays that are together
+// larger than the last level caches, and returns the bytes moved
+static double bandwidth_kernel(std::vector<float> *a,
+                               const std::vector<float> &b,
+                               const std::vector<float> &c, int passes) {
+  const auto n = a->size();
+  auto pa = a->data();
+  const auto pb = b.data(), pc = c.data();
+  for (int pass = 0; pass < passes; pass++) {
+    for (size_t ii = 0; ii < n; ii++) {
+      pa[ii] = pb[ii] + 3.0f * pc[ii];
+    }
+  }
+  return 3.0 * sizeof(float) * n * passes;
+}
+
+// run_on_threads runs fn on num_threads threads at once and returns the
+// total of their results divided by the wall time, in units per second
+template <class Fn>
+static double run_on_threads(int num_threads, Fn fn) {
+  std::vector<double> results(num_threads);
+  std::vector<std::thread> threads{};
+  const auto start = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < num_threads; ii++) {
+    threads.emplace_back([&, ii] { results[ii] = fn(ii); });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  const auto seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+  double total = 0;
+  for (const auto r : results) {
+    total += r;
+  }
+  return total / seconds;
+}
+
+// measure_machine_peak measures the roofline of the machine on num_threads
+// threads, keeping the best of a few repetitions of each benchmark. It
+// takes around a second.
+static machine_peak measure_machine_peak(int num_threads) {
+  num_threads = std::max(num_threads, 1);
+  machine_peak peak{};
+  peak.threads = num_threads;
+  const auto multiply_adds = [](int) { return flops_kernel(1 << 21); };
+  for (int rep = 0; rep < 3; rep++) {
+    const auto gflops = run_on_threads(num_threads, multiply_adds) / 1.0e9;
+    peak.gflops = std::max(peak.gflops, gflops);
+  }
+
+  // the arrays of all the threads add up to four times the last level
+  // cache (at least 64MB), so that the triad streams from memory without
+  // the memory growing with the number of threads
+  const size_t total = std::max(4 * last_level_cache_bytes(), size_t(64) << 20);
+  const size_t n = std::max(total / (3 * sizeof(float) * num_threads),
+                            size_t(64) << 10);
+  std::vector<std::vector<float>> a(num_threads), b(num_threads),
+      c(num_threads);
+  run_on_threads(num_threads, [&](int ii) {
+    a[ii].assign(n, 0.0f);
+    b[ii].assign(n, 1.0f);
+    c[ii].assign(n, 2.0f);
+    return 0.0;
+  });
+  const auto triad = [&](int ii) {
+    return bandwidth_kernel(&a[ii], b[ii], c[ii], 2);
+  };
+  for (int rep = 0; rep < 3; rep++) {
+    const auto gbps = run_on_threads(num_threads, triad) / 1.0e9;
+    peak.gbps = std::max(peak.gbps, gbps);
+  }
+  return peak;
+}
+
+// machine_roofline caches the last measured machine peak of the process
+class machine_roofline {
+ public:
+  static machine_roofline &global() {
+    static machine_roofline roofline{};
+    return roofline;
+  }
+
+  machine_peak measure(int num_threads) {
+    const auto peak = measure_machine_peak(num_threads);
+    std::lock_guard<std::mutex> lock(mut_);
+    peak_ = peak;
+    return peak;
+  }
+
+  machine_peak peak() {
+    std::lock_guard<std::mutex> lock(mut_);
+    return peak_;
+  }
+
+ private:
+  std::mutex mut_;
+  machine_peak peak_{};
+};
+
+}  // namespace mlmodelscope
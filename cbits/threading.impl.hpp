@@ -0,0 +1,170 @@
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif  // __linux__
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// The thread pools of OpenMP and the BLAS libraries are not part of the
+// Caffe2 API. They are looked up as weak symbols, so the ones that are not
+// linked into the process resolve to null and are skipped.
+extern "C" {
+void omp_set_num_threads(int) __attribute__((weak));
+int omp_get_max_threads(void) __attribute__((weak));
+void openblas_set_num_threads(int) __attribute__((weak));
+int openblas_get_num_threads(void) __attribute__((weak));
+int mkl_set_num_threads_local(int) __attribute__((weak));
+}
+
+namespace mlmodelscope {
+
+static std::vector<int> allowed_cpus() {
+  std::vector<int> cpus{};
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.emplace_back(cpu);
+      }
+    }
+  }
+#endif  // __linux__
+  return cpus;
+}
+
+// thread_config holds the intra-op threading settings of a predictor
+struct thread_config {
+  thread_config() = default;
+  thread_config(int num_threads, const int *cpus, int num_cpus)
+      : num_threads_(num_threads) {
+    if (num_threads < 0) {
+      throw std::invalid_argument("the number of threads must be positive");
+    }
+    if (cpus == nullptr || num_cpus <= 0) {
+      return;
+    }
+#ifdef __linux__
+    const auto allowed = allowed_cpus();
+    for (int ii = 0; ii < num_cpus; ii++) {
+      if (std::find(allowed.begin(), allowed.end(), cpus[ii]) !=
+              allowed.end() &&
+          std::find(cpus_.begin(), cpus_.end(), cpus[ii]) == cpus_.end()) {
+        cpus_.emplace_back(cpus[ii]);
+      }
+    }
+    if (cpus_.empty()) {
+      throw std::invalid_argument(
+          "none of the requested cpus are available to the process");
+    }
+#else   // __linux__
+    throw std::invalid_argument("cpu affinity is only supported on linux");
+#endif  // __linux__
+  }
+
+  int num_threads() const { return num_threads_; }
+  const std::vector<int> &cpus() const { return cpus_; }
+  bool empty() const { return num_threads_ == 0 && cpus_.empty(); }
+
+  json to_json() const {
+    return json{
+        {"num_threads", num_threads_},
+        {"cpus", cpus_},
+        {"openmp", omp_set_num_threads != nullptr},
+        {"openmp_max_threads",
+         omp_get_max_threads != nullptr ? omp_get_max_threads() : 0},
+        {"openblas", openblas_set_num_threads != nullptr},
+        {"openblas_threads",
+         openblas_get_num_threads != nullptr ? openblas_get_num_threads() : 0},
+        {"mkl", mkl_set_num_threads_local != nullptr},
+    };
+  }
+
+ private:
+  int num_threads_{0};
+  std::vector<int> cpus_{};
+};
+
+// thread_scope applies a thread_config to the calling thread for the
+// duration of a run and restores the previous settings afterwards. Threads
+// spawned by the libraries while the scope is active inherit its affinity.
+// The OpenMP and MKL settings are per thread. OpenBLAS only has a process
+// wide setting, so the value of the last predictor to run wins there.
+class thread_scope {
+ public:
+  explicit thread_scope(const thread_config &config) : config_(config) {
+    if (config_.empty()) {
+      return;
+    }
+#ifdef __linux__
+    if (!config_.cpus().empty()) {
+      CPU_ZERO(&previous_cpus_);
+      pthread_getaffinity_np(pthread_self(), sizeof(previous_cpus_),
+                             &previous_cpus_);
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (const auto cpu : config_.cpus()) {
+        CPU_SET(cpu, &set);
+      }
+      restore_cpus_ =
+          pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#endif  // __linux__
+    const auto num_threads = config_.num_threads();
+    if (num_threads == 0) {
+      return;
+    }
+    if (omp_set_num_threads != nullptr && omp_get_max_threads != nullptr) {
+      previous_omp_threads_ = omp_get_max_threads();
+      omp_set_num_threads(num_threads);
+    }
+    if (mkl_set_num_threads_local != nullptr) {
+      previous_mkl_threads_ = mkl_set_num_threads_local(num_threads);
+    }
+    if (openblas_set_num_threads != nullptr &&
+        openblas_threads().exchange(num_threads) != num_threads) {
+      openblas_set_num_threads(num_threads);
+    }
+  }
+
+  ~thread_scope() {
+    if (previous_omp_threads_ > 0) {
+      omp_set_num_threads(previous_omp_threads_);
+    }
+    if (previous_mkl_threads_ >= 0) {
+      mkl_set_num_threads_local(previous_mkl_threads_);
+    }
+#ifdef __linux__
+    if (restore_cpus_) {
+      pthread_setaffinity_np(pthread_self(), sizeof(previous_cpus_),
+                             &previous_cpus_);
+    }
+#endif  // __linux__
+  }
+
+ private:
+  static std::atomic<int> &openblas_threads() {
+    static std::atomic<int> threads{0};
+    return threads;
+  }
+
+  const thread_config &config_;
+  int previous_omp_threads_{0};
+  int previous_mkl_threads_{-1};
+#ifdef __linux__
+  cpu_set_t previous_cpus_;
+  bool restore_cpus_{false};
+#endif  // __linux__
+};
+
+}  // namespace mlmodelscope
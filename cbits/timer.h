@@ -7,13 +7,22 @@
 
 typedef int error_t;
 
-const int success = 0;
-const int error_invalid_argument = 1;
-const int error_invalid_memory = 2;
-const int error_not_implemented = 3;
-const int error_exception = 4;
+enum {
+  success = 0,
+  error_invalid_argument = 1,
+  error_invalid_memory = 2,
+  error_not_implemented = 3,
+  error_exception = 4,
+  error_deadline_exceeded = 5,
+  error_cancelled = 6,
+};
 
-struct profile_entry;
+// ClockKind selects the clock the profiles are timed with. The TSC clock
+// reads the time stamp counter of x86 processors whose counter runs at a
+// constant rate.
+typedef enum { STEADY_CLOCK = 0, TSC_CLOCK = 1 } ClockKind;
+
+struct profile_record;
 struct profile;
 
 #endif  // __TIMER_H__
@@ -1,13 +1,25 @@
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define GO_CAFFE2_HAS_TSC
+#endif  // defined(__x86_64__) || defined(__i386__)
+
 #include "json.hpp"
 #include "timer.h"
 
@@ -15,79 +27,432 @@ using json = nlohmann::json;
 
 using shapes_t = std::vector<std::vector<int>>;
 
-using timestamp_t = std::chrono::time_point<std::chrono::system_clock>;
+// timestamp_t is a reading of the profile clock, in ticks of the clock.
+// Timestamps are only converted to nanoseconds (since the epoch) when they
+// are exported, so that taking one costs a single clock read.
+using timestamp_t = uint64_t;
+
+// profile_clock is the clock of the timer subsystem. It is monotonic, so
+// durations are not skewed by wall clock adjustments, and it is either
+// std::chrono::steady_clock (whose ticks are nanoseconds) or the time stamp
+// counter, calibrated against steady_clock once when it is selected. Both
+// are mapped to wall time through a pair of readings taken when the clock
+// is selected.
+class profile_clock {
+ public:
+  static profile_clock &global() {
+    static profile_clock clock{};
+    return clock;
+  }
 
-static timestamp_t now() { return std::chrono::system_clock::now(); }
+  timestamp_t now() const {
+#ifdef GO_CAFFE2_HAS_TSC
+    if (kind_.load(std::memory_order_relaxed) == TSC_CLOCK) {
+      return __rdtsc();
+    }
+#endif  // GO_CAFFE2_HAS_TSC
+    return steady_ns();
+  }
+
+  // select switches to the clock kind, returning false when it is not
+  // available. Timestamps taken before the switch must not be compared
+  // with, or exported after, the ones taken after it.
+  bool select(ClockKind kind) {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (kind == STEADY_CLOCK) {
+      ns_per_tick_ = 1.0;
+    } else if (kind == TSC_CLOCK && tsc_available()) {
+      ns_per_tick_ = calibrate_tsc();
+    } else {
+      return false;
+    }
+    kind_ = kind;
+    reference_ticks_ = now();
+    reference_wall_ns_ = wall_ns();
+    return true;
+  }
+
+  ClockKind kind() const { return kind_.load(); }
+
+  double ns_per_tick() const { return ns_per_tick_; }
+
+  // to_wall_ns converts a timestamp to nanoseconds since the epoch
+  uint64_t to_wall_ns(timestamp_t t) const {
+    const auto delta = static_cast<double>(static_cast<int64_t>(
+                           t - reference_ticks_)) *
+                       ns_per_tick_;
+    return reference_wall_ns_ + static_cast<int64_t>(delta);
+  }
+
+  double elapsed_ns(timestamp_t start, timestamp_t end) const {
+    return static_cast<double>(static_cast<int64_t>(end - start)) *
+           ns_per_tick_;
+  }
+
+  static bool tsc_available() {
+#ifdef GO_CAFFE2_HAS_TSC
+    // the invariant TSC bit tells that the counter runs at a constant rate
+    // across frequency changes and sleep states
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+        eax < 0x80000007) {
+      return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 8)) != 0;
+#else   // GO_CAFFE2_HAS_TSC
+    return false;
+#endif  // GO_CAFFE2_HAS_TSC
+  }
+
+  json to_json() const {
+    return json{
+        {"clock", kind_.load() == TSC_CLOCK ? "tsc" : "steady"},
+        {"ns_per_tick", ns_per_tick_},
+        {"tsc_available", tsc_available()},
+    };
+  }
+
+ private:
+  profile_clock() {
+    reference_ticks_ = now();
+    reference_wall_ns_ = wall_ns();
+  }
+
+  static uint64_t steady_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  static uint64_t wall_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+  }
+
+  // calibrate_tsc measures the TSC period against steady_clock over 20ms
+  static double calibrate_tsc() {
+#ifdef GO_CAFFE2_HAS_TSC
+    const auto start_ns = steady_ns();
+    const auto start_ticks = __rdtsc();
+    uint64_t end_ns = start_ns;
+    while (end_ns - start_ns < 20000000) {
+      end_ns = steady_ns();
+    }
+    const auto end_ticks = __rdtsc();
+    return static_cast<double>(end_ns - start_ns) / (end_ticks - start_ticks);
+#else   // GO_CAFFE2_HAS_TSC
+    return 1.0;
+#endif  // GO_CAFFE2_HAS_TSC
+  }
+
+  std::mutex mut_;
+  std::atomic<ClockKind> kind_{STEADY_CLOCK};
+  double ns_per_tick_{1.0};
+  timestamp_t reference_ticks_{0};
+  uint64_t reference_wall_ns_{0};
+};
+
+static timestamp_t now() { return profile_clock::global().now(); }
 
 static double elapsed_time(timestamp_t start, timestamp_t end) {
-  const auto elapsed =
-      std::chrono::duration<double, std::milli>(end - start).count();
-  return elapsed;
+  return profile_clock::global().elapsed_ns(start, end) / 1.0e6;
 }
 
 static uint64_t to_nanoseconds(timestamp_t t) {
-  const auto duration = t.time_since_epoch();
-  return static_cast<uint64_t>(
-      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+  return profile_clock::global().to_wall_ns(t);
 }
 
-struct profile_entry {
-  profile_entry(int layer_sequence_index, std::string name,
-                std::string metadata, shapes_t shapes)
-      : layer_sequence_index_(layer_sequence_index),
-        name_(name),
-        metadata_(metadata),
-        shapes_(shapes) {
-    start();
+// profile_record is what an operator run leaves in the profile. The names
+// and the shapes are interned, so that recording a run only copies a few
+// integers. The flops and bytes are the estimated work of the run, zero
+// when it is not known. The hardware counters (cycles, instructions, last
+// level cache misses and branch misses) are only valid when has_counters
+// is set.
+static const int num_profile_counters = 4;
+
+struct profile_record {
+  uint64_t profile_id;
+  uint64_t thread_id;
+  timestamp_t start, end;
+  int32_t layer_sequence_index;
+  uint32_t name_id, metadata_id, shapes_id;
+  double flops, bytes;
+  uint64_t counters[num_profile_counters];
+  bool has_counters;
+};
+
+static json counters_to_json(const uint64_t *counters) {
+  const auto cycles = counters[0], instructions = counters[1];
+  return json{
+      {"cycles", cycles},
+      {"instructions", instructions},
+      {"llc_misses", counters[2]},
+      {"branch_misses", counters[3]},
+      {"ipc", cycles == 0 ? 0.0 : static_cast<double>(instructions) / cycles},
+  };
+}
+
+static_assert(std::is_trivially_copyable<profile_record>::value,
+              "profile records are copied in and out of the rings");
+
+// intern_table maps the values interned by the profiling observers to
+// dense ids. Values are interned when an observer is attached or when the
+// input shapes of an operator change, not on every run.
+template <class T, class Hash = std::hash<T>>
+class intern_table {
+ public:
+  uint32_t intern(const T &value) {
+    std::lock_guard<std::mutex> lock(mut_);
+    const auto it = ids_.find(value);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    const auto id = static_cast<uint32_t>(values_.size());
+    values_.emplace_back(value);
+    ids_.emplace(value, id);
+    return id;
   }
-  ~profile_entry() {}
 
-  error_t start() {
-    start_ = now();
-    return success;
+  T get(uint32_t id) {
+    std::lock_guard<std::mutex> lock(mut_);
+    return id < values_.size() ? values_[id] : T{};
   }
 
-  error_t end() {
-    end_ = now();
-    return success;
+ private:
+  std::mutex mut_;
+  std::vector<T> values_{};
+  std::unordered_map<T, uint32_t, Hash> ids_{};
+};
+
+struct shapes_hash {
+  size_t operator()(const shapes_t &shapes) const {
+    size_t h = shapes.size();
+    for (const auto &shape : shapes) {
+      for (const auto d : shape) {
+        h = h * 31 + std::hash<int>()(d);
+      }
+      h = h * 31 + shape.size();
+    }
+    return h;
   }
+};
 
-  json to_json() {
-    const auto start_ns = to_nanoseconds(start_);
-    const auto end_ns = to_nanoseconds(end_);
-    uint64_t id = std::hash<std::thread::id>()(std::this_thread::get_id());
-    return json{
-        {"name", name_},
-        {"metadata", metadata_},
-        {"start", start_ns},
-        {"end", end_ns},
-        {"layer_sequence_index", layer_sequence_index_},
-        {"shapes", shapes_},
-        {"thread_id", id},
-    };
+static intern_table<std::string> &profile_strings() {
+  static intern_table<std::string> table{};
+  return table;
+}
+
+static intern_table<shapes_t, shapes_hash> &profile_shapes() {
+  static intern_table<shapes_t, shapes_hash> table{};
+  return table;
+}
+
+// profile_ring is a preallocated ring of records written by a single
+// thread at a time. Once it wraps around the oldest records are
+// overwritten.
+struct profile_ring {
+  static const size_t capacity = 1 << 13;
+
+  profile_ring() : records(capacity) {}
+
+  void push(const profile_record &record) {
+    const auto h = head.load(std::memory_order_relaxed);
+    records[h % capacity] = record;
+    head.store(h + 1, std::memory_order_release);
   }
 
-  void dump() {
-    const auto j = this->to_json();
-    std::cout << j.dump(2) << "\n";
+  uint64_t thread_id{0};
+  std::vector<profile_record> records;
+  std::atomic<uint64_t> head{0};
+  // cleared when the writing thread exits, the ring then goes to the next
+  // thread that records a run. Its records stay readable until they are
+  // overwritten.
+  bool live{true};
+};
+
+// profile_rings registers the ring of every thread that recorded a run, so
+// that the profiles can be merged when they are read
+class profile_rings {
+ public:
+  static profile_rings &global() {
+    static profile_rings rings{};
+    return rings;
+  }
+
+  // local returns the ring of the calling thread, creating it on first use
+  static profile_ring &local() {
+    static thread_local ring_holder holder{};
+    return *holder.ring;
+  }
+
+  // collect copies the records of profile_id out of the rings. Records
+  // that may have been overwritten while they were copied are left out.
+  std::vector<profile_record> collect(uint64_t profile_id) {
+    std::vector<profile_record> records{};
+    std::lock_guard<std::mutex> lock(mut_);
+    for (const auto &ring : rings_) {
+      const auto capacity = profile_ring::capacity;
+      const auto head = ring->head.load(std::memory_order_acquire);
+      const auto first = head > capacity ? head - capacity : 0;
+      std::vector<std::pair<uint64_t, profile_record>> copied{};
+      for (auto ii = first; ii < head; ii++) {
+        const auto &record = ring->records[ii % capacity];
+        if (record.profile_id == profile_id) {
+          copied.emplace_back(ii, record);
+        }
+      }
+      // the writer may have lapped the slots that were copied first, and
+      // may be writing the slot of after, the one of after - capacity
+      const auto after = ring->head.load(std::memory_order_acquire);
+      const auto valid = after >= capacity ? after - capacity + 1 : 0;
+      for (const auto &c : copied) {
+        if (c.first >= valid) {
+          records.emplace_back(c.second);
+        }
+      }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const profile_record &a, const profile_record &b) {
+                       return a.start < b.start;
+                     });
+    return records;
   }
 
  private:
-  int layer_sequence_index_{0};
-  std::string name_{""};
-  std::string metadata_{""};
-  shapes_t shapes_{};
-  timestamp_t start_{}, end_{};
+  struct ring_holder {
+    ring_holder() {
+      auto &rings = global();
+      std::lock_guard<std::mutex> lock(rings.mut_);
+      for (const auto &r : rings.rings_) {
+        if (!r->live) {
+          ring = r;
+          break;
+        }
+      }
+      if (ring == nullptr) {
+        ring = std::make_shared<profile_ring>();
+        rings.rings_.emplace_back(ring);
+      }
+      ring->live = true;
+      ring->thread_id =
+          std::hash<std::thread::id>()(std::this_thread::get_id());
+    }
+    ~ring_holder() {
+      std::lock_guard<std::mutex> lock(global().mut_);
+      ring->live = false;
+    }
+    std::shared_ptr<profile_ring> ring{nullptr};
+  };
+
+  std::mutex mut_;
+  std::vector<std::shared_ptr<profile_ring>> rings_{};
 };
 
+// profile_writer encodes the binary profiles straight into the buffer of
+// the caller. Once the buffer is full it keeps counting the bytes, so that
+// the caller learns the size it needs; what it wrote of the encoding until
+// then is left in the buffer, which is only valid when the size fits.
+class profile_writer {
+ public:
+  profile_writer(char *buffer, size_t capacity)
+      : buffer_(buffer), capacity_(buffer == nullptr ? 0 : capacity) {}
+
+  void put_byte(uint8_t b) {
+    if (size_ < capacity_) {
+      buffer_[size_] = static_cast<char>(b);
+    }
+    size_++;
+  }
+
+  void put_bytes(const char *bytes, size_t n) {
+    if (size_ + n <= capacity_) {
+      memcpy(buffer_ + size_, bytes, n);
+    }
+    size_ += n;
+  }
+
+  // put_varint writes v 7 bits at a time, least significant first
+  void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+      put_byte(static_cast<uint8_t>(v) | 0x80);
+      v >>= 7;
+    }
+    put_byte(static_cast<uint8_t>(v));
+  }
+
+  // put_signed zigzag encodes v so that small magnitudes stay small
+  void put_signed(int64_t v) {
+    put_varint((static_cast<uint64_t>(v) << 1) ^
+               static_cast<uint64_t>(v >> 63));
+  }
+
+  void put_string(const std::string &s) {
+    put_varint(s.size());
+    put_bytes(s.data(), s.size());
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  char *buffer_;
+  size_t capacity_;
+  size_t size_{0};
+};
+
+// dense_ids renumbers the sparse ids of a table from 0, in order of first
+// use
+class dense_ids {
+ public:
+  uint64_t get(uint64_t id) {
+    const auto it = ids_.find(id);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    const auto n = static_cast<uint64_t>(order_.size());
+    ids_.emplace(id, n);
+    order_.emplace_back(id);
+    return n;
+  }
+
+  const std::vector<uint64_t> &order() const { return order_; }
+
+ private:
+  std::unordered_map<uint64_t, uint64_t> ids_{};
+  std::vector<uint64_t> order_{};
+};
+
+// memory_event is an allocation (positive bytes) or a free (negative
+// bytes) made while a profile was recorded, with the live bytes of the
+// predictor after it and the operator it is attributed to, -1 when it
+// happened outside of the operators
+struct memory_event {
+  timestamp_t time;
+  int64_t bytes;
+  int64_t live_bytes;
+  int32_t layer_sequence_index;
+};
+
+static uint64_t next_profile_id() {
+  static std::atomic<uint64_t> id{0};
+  return ++id;
+}
+
 struct profile {
+  static const uint64_t binary_version = 4;
+  static const size_t memory_capacity = 1 << 16;
+
   profile(std::string name = "", std::string metadata = "")
-      : name_(name), metadata_(metadata) {
+      : name_(name), metadata_(metadata), id_(next_profile_id()) {
     start();
   }
-  ~profile() { this->reset(); }
+  ~profile() {}
 
   error_t start() {
+    thread_id_ = std::hash<std::thread::id>()(std::this_thread::get_id());
     start_ = now();
     return success;
   }
@@ -97,37 +462,363 @@ struct profile {
     return success;
   }
 
+  // reset drops the records of the profile. They are left in the rings,
+  // the profile just stops claiming them.
   error_t reset() {
-    std::lock_guard<std::mutex> lock(mut_);
-    for (auto e : entries_) {
-      if (e != nullptr) {
-        delete e;
-      }
-    }
-    entries_.clear();
+    id_ = next_profile_id();
+    recorded_ = 0;
+    std::lock_guard<std::mutex> lock(memory_mut_);
+    memory_.clear();
+    dropped_memory_events_ = 0;
     return success;
   }
 
-  error_t add(profile_entry *entry) {
-    std::lock_guard<std::mutex> lock(mut_);
-    entries_.emplace_back(entry);
-    return success;
+  uint64_t id() const { return id_; }
+
+  // record adds an operator run to the profile. It does not allocate nor
+  // lock, the record goes to the ring of the calling thread and is only
+  // counted in the profile.
+  // counters are the deltas of the hardware counters over the run, null
+  // when they were not read.
+  void record(int layer_sequence_index, uint32_t name_id,
+              uint32_t metadata_id, uint32_t shapes_id, timestamp_t start,
+              timestamp_t end, double flops, double bytes,
+              const uint64_t *counters) {
+    auto &ring = profile_rings::local();
+    profile_record record;
+    record.profile_id = id_;
+    record.thread_id = ring.thread_id;
+    record.start = start;
+    record.end = end;
+    record.layer_sequence_index = layer_sequence_index;
+    record.name_id = name_id;
+    record.metadata_id = metadata_id;
+    record.shapes_id = shapes_id;
+    record.flops = flops;
+    record.bytes = bytes;
+    record.has_counters = counters != nullptr;
+    if (counters != nullptr) {
+      memcpy(record.counters, counters, sizeof(record.counters));
+    }
+    ring.push(record);
+    recorded_.fetch_add(1, std::memory_order_relaxed);
   }
 
-  json to_json() {
-    std::lock_guard<std::mutex> lock(mut_);
+  // collect returns the records of the profile that are still in the
+  // rings. A ring is shared by all the predictors its thread serves and
+  // may wrap around before the profile is read, the records of the
+  // profile it overwrote are counted in dropped.
+  std::vector<profile_record> collect(uint64_t *dropped) const {
+    const auto recorded = recorded_.load(std::memory_order_relaxed);
+    auto records = profile_rings::global().collect(id_);
+    *dropped = recorded > records.size() ? recorded - records.size() : 0;
+    return records;
+  }
 
+  // record_memory adds an allocation or a free to the memory timeline of
+  // the profile. They are far less frequent than the operator runs, since
+  // the workspace reuses its buffers across runs, and already go through
+  // the allocator locks, so they are kept under a lock. The timeline is
+  // bounded, the events past its capacity are counted as dropped.
+  void record_memory(timestamp_t time, int64_t bytes, int64_t live_bytes,
+                     int layer_sequence_index) {
+    std::lock_guard<std::mutex> lock(memory_mut_);
+    if (memory_.size() >= memory_capacity) {
+      dropped_memory_events_++;
+      return;
+    }
+    memory_.emplace_back(
+        memory_event{time, bytes, live_bytes, layer_sequence_index});
+  }
+
+  // memory_to_json returns the memory timeline and, for each operator, the
+  // bytes it allocated and freed and the peak live bytes during its runs
+  json memory_to_json() {
+    std::vector<memory_event> events{};
+    uint64_t dropped = 0;
+    {
+      std::lock_guard<std::mutex> lock(memory_mut_);
+      events = memory_;
+      dropped = dropped_memory_events_;
+    }
+    struct layer_memory {
+      int64_t allocations{0}, allocated_bytes{0}, frees{0}, freed_bytes{0},
+          peak_live_bytes{0};
+    };
+    std::map<int, layer_memory> layers{};
+    json timeline = json::array();
+    int64_t peak = 0;
+    int peak_layer = -1;
+    for (const auto &e : events) {
+      timeline.emplace_back(json{
+          {"time", to_nanoseconds(e.time)},
+          {"bytes", e.bytes},
+          {"live_bytes", e.live_bytes},
+          {"layer_sequence_index", e.layer_sequence_index},
+      });
+      auto &layer = layers[e.layer_sequence_index];
+      if (e.bytes >= 0) {
+        layer.allocations++;
+        layer.allocated_bytes += e.bytes;
+      } else {
+        layer.frees++;
+        layer.freed_bytes -= e.bytes;
+      }
+      layer.peak_live_bytes = std::max(layer.peak_live_bytes, e.live_bytes);
+      if (e.live_bytes > peak) {
+        peak = e.live_bytes;
+        peak_layer = e.layer_sequence_index;
+      }
+    }
+    json by_layer = json::array();
+    for (const auto &kv : layers) {
+      by_layer.emplace_back(json{
+          {"layer_sequence_index", kv.first},
+          {"allocations", kv.second.allocations},
+          {"allocated_bytes", kv.second.allocated_bytes},
+          {"frees", kv.second.frees},
+          {"freed_bytes", kv.second.freed_bytes},
+          {"peak_live_bytes", kv.second.peak_live_bytes},
+      });
+    }
+    return json{
+        {"timeline", timeline},
+        {"layers", by_layer},
+        {"peak_live_bytes", peak},
+        {"peak_layer_sequence_index", peak_layer},
+        {"dropped", dropped},
+    };
+  }
+
+  json to_json() {
     const auto start_ns = to_nanoseconds(start_);
     const auto end_ns = to_nanoseconds(end_);
 
+    uint64_t dropped = 0;
+    const auto records = collect(&dropped);
+    auto &strings = profile_strings();
+    auto &shapes = profile_shapes();
     json elements = json::array();
-    for (const auto e : entries_) {
-      elements.emplace_back(e->to_json());
+    for (const auto &r : records) {
+      // flops and bytes per nanosecond are GFLOP/s and GB/s
+      const auto ns = profile_clock::global().elapsed_ns(r.start, r.end);
+      elements.emplace_back(json{
+          {"name", strings.get(r.name_id)},
+          {"metadata", strings.get(r.metadata_id)},
+          {"start", to_nanoseconds(r.start)},
+          {"end", to_nanoseconds(r.end)},
+          {"layer_sequence_index", r.layer_sequence_index},
+          {"shapes", shapes.get(r.shapes_id)},
+          {"thread_id", r.thread_id},
+          {"flops", r.flops},
+          {"bytes", r.bytes},
+          {"gflops", ns > 0 ? r.flops / ns : 0.0},
+          {"gbps", ns > 0 ? r.bytes / ns : 0.0},
+          {"arithmetic_intensity", r.bytes > 0 ? r.flops / r.bytes : 0.0},
+      });
+      if (r.has_counters) {
+        elements.back()["counters"] = counters_to_json(r.counters);
+      }
     }
     return json{
-        {"name", name_}, {"metadata", metadata_}, {"start", start_ns},
-        {"end", end_ns}, {"elements", elements},
+        {"name", name_},     {"metadata", metadata_}, {"start", start_ns},
+        {"end", end_ns},     {"elements", elements},  {"dropped", dropped},
+        {"memory", memory_to_json()},
+    };
+  }
+
+  // to_chrome_trace exports the profile in the Trace Event Format read by
+  // chrome://tracing and Perfetto. The net run and the operators are
+  // complete ("X") events, timed in microseconds. The operators run by the
+  // thread that ran the net are nested in the net event. Threads are
+  // numbered in order of appearance and named after their ids.
+  json to_chrome_trace() {
+    uint64_t dropped = 0;
+    const auto records = collect(&dropped);
+    auto &strings = profile_strings();
+    auto &shapes = profile_shapes();
+    const int pid = 1;
+    std::map<uint64_t, int> tids{};
+    const auto tid = [&](uint64_t thread_id) {
+      const auto it = tids.find(thread_id);
+      if (it != tids.end()) {
+        return it->second;
+      }
+      const auto n = static_cast<int>(tids.size()) + 1;
+      tids.emplace(thread_id, n);
+      return n;
     };
+    const auto us = [](uint64_t ns) { return ns / 1000.0; };
+
+    json events = json::array();
+    const auto start_ns = to_nanoseconds(start_);
+    const auto end_ns = to_nanoseconds(end_);
+    events.emplace_back(json{
+        {"name", name_},
+        {"cat", "net"},
+        {"ph", "X"},
+        {"ts", us(start_ns)},
+        {"dur", us(end_ns - start_ns)},
+        {"pid", pid},
+        {"tid", tid(thread_id_)},
+        {"args", json{{"metadata", metadata_}, {"dropped", dropped}}},
+    });
+    for (const auto &r : records) {
+      const auto op_start_ns = to_nanoseconds(r.start);
+      const auto op_end_ns = to_nanoseconds(r.end);
+      events.emplace_back(json{
+          {"name", strings.get(r.name_id)},
+          {"cat", "operator"},
+          {"ph", "X"},
+          {"ts", us(op_start_ns)},
+          {"dur", us(op_end_ns - op_start_ns)},
+          {"pid", pid},
+          {"tid", tid(r.thread_id)},
+          {"args",
+           json{
+               {"metadata", strings.get(r.metadata_id)},
+               {"layer_sequence_index", r.layer_sequence_index},
+               {"shapes", shapes.get(r.shapes_id)},
+               {"flops", r.flops},
+               {"bytes", r.bytes},
+           }},
+      });
+      if (r.has_counters) {
+        events.back()["args"]["counters"] = counters_to_json(r.counters);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(memory_mut_);
+      for (const auto &e : memory_) {
+        events.emplace_back(json{
+            {"name", "memory"},
+            {"ph", "C"},
+            {"ts", us(to_nanoseconds(e.time))},
+            {"pid", pid},
+            {"args", json{{"live_bytes", e.live_bytes}}},
+        });
+      }
+    }
+    events.emplace_back(json{
+        {"name", "process_name"},
+        {"ph", "M"},
+        {"pid", pid},
+        {"args", json{{"name", "caffe2"}}},
+    });
+    for (const auto &kv : tids) {
+      events.emplace_back(json{
+          {"name", "thread_name"},
+          {"ph", "M"},
+          {"pid", pid},
+          {"tid", kv.second},
+          {"args", json{{"name", "thread " + std::to_string(kv.first)}}},
+      });
+    }
+    return json{{"traceEvents", events}, {"displayTimeUnit", "ns"}};
+  }
+
+  // write_binary encodes the profile into buffer and returns the size of
+  // the encoding. When it exceeds capacity the buffer holds a part of the
+  // encoding, which is not to be decoded. The
+  // layout is, with every integer a LEB128 varint (zigzag encoded when
+  // signed) and every string its length then its bytes:
+  //
+  //   "C2PF" version name metadata start_ns duration_ns dropped thread
+  //   strings: count string...
+  //   shapes:  count (count (rank dim...)...)...
+  //   threads: count thread_id...
+  //   records: count (start_delta_ns duration_ns layer_sequence_index
+  //                   name metadata shapes thread flops bytes
+  //                   has_counters [cycles instructions llc_misses
+  //                   branch_misses])...
+  //   memory:  dropped count (time_delta_ns bytes live_bytes
+  //                           layer_sequence_index)...
+  //
+  // The start of a record (and the time of a memory event) is relative to
+  // the previous one, the first to the start of the profile, and the
+  // names, shapes and threads are indices in their tables. The thread of
+  // the profile is the one that ran the net.
+  size_t write_binary(char *buffer, size_t capacity) {
+    uint64_t dropped = 0;
+    const auto records = collect(&dropped);
+    dense_ids strings{}, shapes{}, threads{};
+    const auto net_thread = threads.get(thread_id_);
+    for (const auto &r : records) {
+      strings.get(r.name_id);
+      strings.get(r.metadata_id);
+      shapes.get(r.shapes_id);
+      threads.get(r.thread_id);
+    }
+
+    profile_writer w(buffer, capacity);
+    w.put_bytes("C2PF", 4);
+    w.put_varint(binary_version);
+    w.put_string(name_);
+    w.put_string(metadata_);
+    const auto start_ns = to_nanoseconds(start_);
+    w.put_varint(start_ns);
+    w.put_signed(static_cast<int64_t>(to_nanoseconds(end_) - start_ns));
+    w.put_varint(dropped);
+    w.put_varint(net_thread);
+
+    auto &string_table = profile_strings();
+    w.put_varint(strings.order().size());
+    for (const auto id : strings.order()) {
+      w.put_string(string_table.get(static_cast<uint32_t>(id)));
+    }
+    auto &shapes_table = profile_shapes();
+    w.put_varint(shapes.order().size());
+    for (const auto id : shapes.order()) {
+      const auto s = shapes_table.get(static_cast<uint32_t>(id));
+      w.put_varint(s.size());
+      for (const auto &shape : s) {
+        w.put_varint(shape.size());
+        for (const auto d : shape) {
+          w.put_signed(d);
+        }
+      }
+    }
+    w.put_varint(threads.order().size());
+    for (const auto id : threads.order()) {
+      w.put_varint(id);
+    }
+
+    w.put_varint(records.size());
+    auto previous_ns = start_ns;
+    for (const auto &r : records) {
+      const auto record_start_ns = to_nanoseconds(r.start);
+      w.put_signed(static_cast<int64_t>(record_start_ns - previous_ns));
+      w.put_signed(static_cast<int64_t>(to_nanoseconds(r.end) -
+                                        record_start_ns));
+      w.put_signed(r.layer_sequence_index);
+      w.put_varint(strings.get(r.name_id));
+      w.put_varint(strings.get(r.metadata_id));
+      w.put_varint(shapes.get(r.shapes_id));
+      w.put_varint(threads.get(r.thread_id));
+      w.put_varint(static_cast<uint64_t>(r.flops));
+      w.put_varint(static_cast<uint64_t>(r.bytes));
+      w.put_varint(r.has_counters ? 1 : 0);
+      if (r.has_counters) {
+        for (const auto c : r.counters) {
+          w.put_varint(c);
+        }
+      }
+      previous_ns = record_start_ns;
+    }
+
+    std::lock_guard<std::mutex> lock(memory_mut_);
+    w.put_varint(dropped_memory_events_);
+    w.put_varint(memory_.size());
+    previous_ns = start_ns;
+    for (const auto &e : memory_) {
+      const auto time_ns = to_nanoseconds(e.time);
+      w.put_signed(static_cast<int64_t>(time_ns - previous_ns));
+      w.put_signed(e.bytes);
+      w.put_signed(e.live_bytes);
+      w.put_signed(e.layer_sequence_index);
+      previous_ns = time_ns;
+    }
+    return w.size();
   }
 
   void dump() {
@@ -140,10 +831,306 @@ struct profile {
     return j.dump();
   }
 
+  std::string read_chrome_trace() {
+    const auto j = this->to_chrome_trace();
+    return j.dump();
+  }
+
  private:
   std::string name_{""};
   std::string metadata_{""};
-  std::vector<profile_entry *> entries_{};
+  std::atomic<uint64_t> id_{0};
+  uint64_t thread_id_{0};
   timestamp_t start_{}, end_{};
+  std::mutex memory_mut_;
+  std::vector<memory_event> memory_{};
+  uint64_t dropped_memory_events_{0};
+  // number of operator runs recorded since the last reset
+  std::atomic<uint64_t> recorded_{0};
+};
+
+// latency_histogram aggregates durations into log-linear buckets: each
+// power of two of nanoseconds is split in sub_buckets equal buckets, which
+// bounds the relative error of the percentiles to 1/sub_buckets. Adding a
+// duration only touches atomics.
+class latency_histogram {
+ public:
+  static const int sub_bucket_bits = 2;
+  static const int sub_buckets = 1 << sub_bucket_bits;
+  static const int num_buckets = 64 * sub_buckets;
+
+  latency_histogram() { reset(); }
+
+  void add(uint64_t ns) {
+    buckets_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    auto min = min_ns_.load(std::memory_order_relaxed);
+    while (ns < min && !min_ns_.compare_exchange_weak(min, ns)) {
+    }
+    auto max = max_ns_.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns_.compare_exchange_weak(max, ns)) {
+    }
+  }
+
+  void reset() {
+    for (auto &b : buckets_) {
+      b = 0;
+    }
+    count_ = 0;
+    sum_ns_ = 0;
+    min_ns_ = UINT64_MAX;
+    max_ns_ = 0;
+  }
+
+  json to_json() const {
+    std::vector<uint64_t> buckets(num_buckets);
+    uint64_t count = 0;
+    for (int ii = 0; ii < num_buckets; ii++) {
+      buckets[ii] = buckets_[ii].load(std::memory_order_relaxed);
+      count += buckets[ii];
+    }
+    const auto min = min_ns_.load(), max = max_ns_.load();
+    // the percentiles are the midpoints of their buckets, clamped to the
+    // observed range
+    const auto percentile = [&](double p) -> uint64_t {
+      if (count == 0) {
+        return 0;
+      }
+      const auto rank = static_cast<uint64_t>(std::ceil(p * count));
+      uint64_t seen = 0;
+      for (int ii = 0; ii < num_buckets; ii++) {
+        seen += buckets[ii];
+        if (seen >= rank && buckets[ii] != 0) {
+          const auto mid = (lower_bound(ii) + lower_bound(ii + 1)) / 2;
+          return std::min(std::max(mid, min), max);
+        }
+      }
+      return max;
+    };
+    json nonempty = json::array();
+    for (int ii = 0; ii < num_buckets; ii++) {
+      if (buckets[ii] != 0) {
+        nonempty.emplace_back(json{{"lower_ns", lower_bound(ii)},
+                                   {"upper_ns", lower_bound(ii + 1)},
+                                   {"count", buckets[ii]}});
+      }
+    }
+    return json{
+        {"count", count},
+        {"sum_ns", sum_ns_.load()},
+        {"min_ns", count == 0 ? 0 : min},
+        {"max_ns", max},
+        {"mean_ns", count == 0 ? 0.0 : static_cast<double>(sum_ns_) / count},
+        {"p50_ns", percentile(0.5)},
+        {"p90_ns", percentile(0.9)},
+        {"p99_ns", percentile(0.99)},
+        {"p999_ns", percentile(0.999)},
+        {"buckets", nonempty},
+    };
+  }
+
+ private:
+  // the durations below sub_buckets nanoseconds get a bucket each, the
+  // others are bucketed by their leading bit and the sub_bucket_bits that
+  // follow it
+  static int bucket(uint64_t ns) {
+    if (ns < sub_buckets) {
+      return static_cast<int>(ns);
+    }
+    const int msb = 63 - __builtin_clzll(ns);
+    const int shift = msb - sub_bucket_bits;
+    const auto sub = static_cast<int>((ns >> shift) & (sub_buckets - 1));
+    return std::min((shift + 1) * sub_buckets + sub, num_buckets - 1);
+  }
+
+  static uint64_t lower_bound(int bucket) {
+    if (bucket < sub_buckets) {
+      return bucket;
+    }
+    const int shift = bucket / sub_buckets - 1;
+    const auto sub = static_cast<uint64_t>(bucket % sub_buckets);
+    if (shift >= 62) {
+      return UINT64_MAX;
+    }
+    return (sub_buckets + sub) << shift;
+  }
+
+  std::atomic<uint64_t> buckets_[num_buckets];
+  std::atomic<uint64_t> count_{0}, sum_ns_{0}, min_ns_{UINT64_MAX},
+      max_ns_{0};
+};
+
+// op_histograms holds the latency histograms of the nets of a predictor:
+// for each net, by name, the one of the whole net and the ones of its
+// operators, by layer_sequence_index. Keeping them per net keeps the runs
+// of the partial nets, which number their operators on their own, out of
+// the histograms of the full net. The histograms are created when the
+// observers are attached and live as long as the predictor, so the
+// observers keep plain pointers to them.
+class op_histograms {
+ public:
+  latency_histogram *get(const std::string &net_name,
+                         int layer_sequence_index, const std::string &name,
+                         const std::string &metadata) {
+    std::lock_guard<std::mutex> lock(mut_);
+    auto &op = nets_[net_name].ops[layer_sequence_index];
+    if (op.histogram == nullptr) {
+      op.name = name;
+      op.metadata = metadata;
+      op.histogram.reset(new latency_histogram());
+    }
+    return op.histogram.get();
+  }
+
+  latency_histogram *net(const std::string &net_name) {
+    std::lock_guard<std::mutex> lock(mut_);
+    auto &net = nets_[net_name].net;
+    if (net == nullptr) {
+      net.reset(new latency_histogram());
+    }
+    return net.get();
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mut_);
+    for (auto &net : nets_) {
+      if (net.second.net != nullptr) {
+        net.second.net->reset();
+      }
+      for (auto &kv : net.second.ops) {
+        kv.second.histogram->reset();
+      }
+    }
+  }
+
+  json to_json() {
+    std::lock_guard<std::mutex> lock(mut_);
+    json nets = json::array();
+    for (const auto &net : nets_) {
+      json ops = json::array();
+      for (const auto &kv : net.second.ops) {
+        auto op = kv.second.histogram->to_json();
+        op["layer_sequence_index"] = kv.first;
+        op["name"] = kv.second.name;
+        op["metadata"] = kv.second.metadata;
+        ops.emplace_back(op);
+      }
+      const auto whole = net.second.net != nullptr
+                             ? net.second.net->to_json()
+                             : latency_histogram().to_json();
+      nets.emplace_back(
+          json{{"name", net.first}, {"net", whole}, {"ops", ops}});
+    }
+    return json{{"nets", nets}};
+  }
+
+ private:
+  struct op_histogram {
+    std::string name{""}, metadata{""};
+    std::unique_ptr<latency_histogram> histogram{nullptr};
+  };
+  struct net_histograms {
+    std::unique_ptr<latency_histogram> net{nullptr};
+    std::map<int, op_histogram> ops{};
+  };
+
+  std::mutex mut_;
+  std::map<std::string, net_histograms> nets_{};
+};
+
+// profile_sampler decides which runs of a predictor are profiled when
+// profiling is left on for production traffic, and keeps the last profiles
+// it sampled. A run is sampled when it is one of every `every` runs, or
+// when a latency threshold is set and it takes longer than the threshold.
+// Since a run can only be known to be slow once it is over, every run is
+// recorded when a threshold is set, but only the profiles that are kept are
+// serialized.
+class profile_sampler {
+ public:
+  void configure(int64_t every, int64_t threshold_us, size_t keep) {
+    std::lock_guard<std::mutex> lock(mut_);
+    every_ = every;
+    threshold_us_ = threshold_us;
+    keep_ = keep;
+    while (profiles_.size() > keep_) {
+      profiles_.erase(profiles_.begin());
+    }
+    enabled_ = keep > 0 && (every > 0 || threshold_us > 0);
+  }
+
+  void disable() { enabled_ = false; }
+
+  // should_profile tells whether the next run must be recorded, and
+  // whether it is sampled by rate, in which case it is kept whatever its
+  // latency
+  bool should_profile(bool *by_rate) {
+    *by_rate = false;
+    if (!enabled_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mut_);
+    runs_++;
+    *by_rate = every_ > 0 && runs_ % every_ == 0;
+    return *by_rate || threshold_us_ > 0;
+  }
+
+  // offer keeps the profile of a recorded run when it was sampled by rate,
+  // exceeded the latency threshold or was aborted, dropping the oldest
+  // profile kept when there are too many
+  void offer(profile *prof, double latency_ms, bool by_rate,
+             bool aborted = false) {
+    bool slow = false;
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      slow = threshold_us_ > 0 && latency_ms * 1000 >= threshold_us_;
+      if (!by_rate && !slow && !aborted) {
+        return;
+      }
+    }
+    auto j = prof->to_json();
+    j["latency_ms"] = latency_ms;
+    j["reason"] = aborted ? "aborted" : slow ? "latency" : "rate";
+    std::lock_guard<std::mutex> lock(mut_);
+    sampled_++;
+    profiles_.emplace_back(j.dump());
+    while (profiles_.size() > keep_) {
+      profiles_.erase(profiles_.begin());
+    }
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mut_);
+    profiles_.clear();
+  }
+
+  std::string read() {
+    std::lock_guard<std::mutex> lock(mut_);
+    // the kept profiles are already serialized, they are spliced into the
+    // report instead of being parsed again
+    std::string s = json{
+        {"enabled", enabled_.load()},
+        {"every", every_},
+        {"threshold_us", threshold_us_},
+        {"keep", keep_},
+        {"runs", runs_},
+        {"sampled", sampled_},
+    }.dump();
+    s.pop_back();
+    s += ",\"profiles\":[";
+    for (size_t ii = 0; ii < profiles_.size(); ii++) {
+      s += ii == 0 ? "" : ",";
+      s += profiles_[ii];
+    }
+    s += "]}";
+    return s;
+  }
+
+ private:
+  std::atomic<bool> enabled_{false};
   std::mutex mut_;
+  int64_t every_{0}, threshold_us_{0};
+  size_t keep_{0};
+  int64_t runs_{0}, sampled_{0};
+  std::vector<std::string> profiles_{};
 };
@@ -0,0 +1,75 @@
+package caffe2
+
+import (
+	"context"
+	"io/ioutil"
+	"math"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/rai-project/dlframework/framework/options"
+)
+
+// createTestPredictor creates a cpu predictor for a model given as text
+// format init and predict nets, which caffe2 reads as well as binary ones.
+func createTestPredictor(t *testing.T, initNet, predictNet string, predOpts PredictorOptions) (*Predictor, error) {
+	dir, err := ioutil.TempDir("", "go-caffe2")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	initNetFile := filepath.Join(dir, "init_net.pbtxt")
+	predictNetFile := filepath.Join(dir, "predict_net.pbtxt")
+	if err := ioutil.WriteFile(initNetFile, []byte(initNet), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if err := ioutil.WriteFile(predictNetFile, []byte(predictNet), 0644); err != nil {
+		t.Fatal(err)
+	}
+
+	return NewWithOptions(
+		context.Background(),
+		predOpts,
+		options.Device(options.CPU_DEVICE, 0),
+		options.Graph([]byte(predictNetFile)),
+		options.Weights([]byte(initNetFile)),
+		options.BatchSize(1),
+	)
+}
+
+// newTestPredictor is createTestPredictor failing the test on error.
+func newTestPredictor(t *testing.T, initNet, predictNet string, predOpts PredictorOptions) *Predictor {
+	pred, err := createTestPredictor(t, initNet, predictNet, predOpts)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return pred
+}
+
+// predictOnce runs a single 1xCxWxH prediction and returns a copy of its
+// output.
+func predictOnce(t *testing.T, pred *Predictor, input []float32, channels, width, height int) []float32 {
+	ctx := context.Background()
+	if err := pred.Predict(ctx, input, channels, width, height); err != nil {
+		t.Fatal(err)
+	}
+	output, err := pred.ReadPredictionOutput(ctx)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return append([]float32(nil), output...)
+}
+
+func assertClose(t *testing.T, got, want []float32) {
+	t.Helper()
+	if len(got) != len(want) {
+		t.Fatalf("got %d values, want %d", len(got), len(want))
+	}
+	for ii := range got {
+		if math.Abs(float64(got[ii]-want[ii])) > 1e-4 {
+			t.Fatalf("value %d is %v, want %v (got %v, want %v)", ii, got[ii], want[ii], got, want)
+		}
+	}
+}
@@ -0,0 +1,244 @@
+package caffe2
+
+import (
+	"encoding/json"
+	"strings"
+	"testing"
+)
+
+// the parameters of a 1x1 convolution from one channel to two, followed by
+// a batch norm
+const convBNInitNet = `
+name: "conv_bn_init"
+op {
+  output: "conv_w"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 ints: 1 ints: 1 ints: 1 }
+  arg { name: "values" floats: 0.5 floats: -1.5 }
+}
+op {
+  output: "conv_b"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 }
+  arg { name: "values" floats: 0.25 floats: 0.5 }
+}
+op {
+  output: "bn_scale"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 }
+  arg { name: "values" floats: 2 floats: 0.5 }
+}
+op {
+  output: "bn_bias"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 }
+  arg { name: "values" floats: -0.5 floats: 1 }
+}
+op {
+  output: "bn_mean"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 }
+  arg { name: "values" floats: 0.1 floats: -0.2 }
+}
+op {
+  output: "bn_var"
+  type: "GivenTensorFill"
+  arg { name: "shape" ints: 2 }
+  arg { name: "values" floats: 4 floats: 0.25 }
+}
+`
+
+const convOp = `
+op {
+  input: "data" input: "conv_w" input: "conv_b"
+  output: "conv"
+  type: "Conv"
+  arg { name: "kernel" i: 1 }
+  arg { name: "order" s: "NCHW" }
+}
+`
+
+const inPlaceBNOp = `
+op {
+  input: "conv" input: "bn_scale" input: "bn_bias" input: "bn_mean" input: "bn_var"
+  output: "conv"
+  type: "SpatialBN"
+  arg { name: "is_test" i: 1 }
+  arg { name: "epsilon" f: 0.00001 }
+}
+`
+
+const inPlaceReluOp = `
+op { input: "conv" output: "conv" type: "Relu" }
+`
+
+const convBNNetHeader = `
+name: "conv_bn_relu"
+external_input: "data"
+external_input: "conv_w"
+external_input: "conv_b"
+external_input: "bn_scale"
+external_input: "bn_bias"
+external_input: "bn_mean"
+external_input: "bn_var"
+external_output: "prob"
+`
+
+// the standard in-place Conv -> SpatialBN -> Relu chain, whose output is
+// read downstream
+const convBNReluPredictNet = convBNNetHeader + convOp + inPlaceBNOp + inPlaceReluOp + `
+op { input: "conv" output: "prob" type: "Scale" arg { name: "scale" f: 2 } }
+`
+
+// the convolution output is read before the in-place batch norm overwrites
+// it, so the batch norm cannot be folded into the convolution
+const convSkipBNPredictNet = convBNNetHeader + convOp + `
+op { input: "conv" output: "skip" type: "Scale" arg { name: "scale" f: 3 } }
+` + inPlaceBNOp + inPlaceReluOp + `
+op { input: "conv" input: "skip" output: "prob" type: "Add" }
+`
+
+var convBNInput = []float32{-2, -0.5, 0.75, 3}
+
+type testOptimizationReport struct {
+	OpsBefore int `json:"ops_before"`
+	OpsAfter  int `json:"ops_after"`
+	Rewrites  []struct {
+		Pass   string `json:"pass"`
+		Detail string `json:"detail"`
+	} `json:"rewrites"`
+}
+
+func readTestOptimizationReport(t *testing.T, pred *Predictor) (*testOptimizationReport, map[string]int) {
+	s, err := pred.ReadOptimizationReport()
+	if err != nil {
+		t.Fatal(err)
+	}
+	report := &testOptimizationReport{}
+	if err := json.Unmarshal([]byte(s), report); err != nil {
+		t.Fatal(err)
+	}
+	passes := map[string]int{}
+	for _, r := range report.Rewrites {
+		passes[r.Pass]++
+	}
+	return report, passes
+}
+
+func TestOptimizerFoldsInPlaceBatchNorm(t *testing.T) {
+	plain := newTestPredictor(t, convBNInitNet, convBNReluPredictNet, PredictorOptions{DisableGraphOptimizations: true})
+	defer plain.Close()
+	optimized := newTestPredictor(t, convBNInitNet, convBNReluPredictNet, PredictorOptions{})
+	defer optimized.Close()
+
+	report, passes := readTestOptimizationReport(t, optimized)
+	if passes["fold_batch_norm"] != 1 {
+		t.Fatalf("the in-place batch norm was not folded: %+v", report)
+	}
+	// the relu is only fused when ConvRelu is registered
+	wantOps := 3
+	if passes["fuse_conv_relu"] == 1 {
+		wantOps = 2
+	}
+	if report.OpsBefore != 4 || report.OpsAfter != wantOps {
+		t.Fatalf("got %d ops out of %d, want %d out of 4", report.OpsAfter, report.OpsBefore, wantOps)
+	}
+
+	want := predictOnce(t, plain, convBNInput, 1, 2, 2)
+	got := predictOnce(t, optimized, convBNInput, 1, 2, 2)
+	assertClose(t, got, want)
+}
+
+func TestOptimizerKeepsObservedBatchNormInput(t *testing.T) {
+	plain := newTestPredictor(t, convBNInitNet, convSkipBNPredictNet, PredictorOptions{DisableGraphOptimizations: true})
+	defer plain.Close()
+	optimized := newTestPredictor(t, convBNInitNet, convSkipBNPredictNet, PredictorOptions{})
+	defer optimized.Close()
+
+	report, passes := readTestOptimizationReport(t, optimized)
+	if passes["fold_batch_norm"] != 0 {
+		t.Fatalf("a batch norm whose input is read elsewhere was folded: %+v", report)
+	}
+
+	want := predictOnce(t, plain, convBNInput, 1, 2, 2)
+	got := predictOnce(t, optimized, convBNInput, 1, 2, 2)
+	assertClose(t, got, want)
+}
+
+// a 1x1 convolution followed by an in-place relu, which the default
+// optimizations fuse
+const convReluPredictNet = `
+name: "conv_relu"
+external_input: "data"
+external_input: "conv_w"
+external_input: "conv_b"
+external_output: "prob"
+` + convOp + inPlaceReluOp + `
+op { input: "conv" output: "prob" type: "Scale" arg { name: "scale" f: 2 } }
+`
+
+func TestInputNormalizationWithGraphOptimizations(t *testing.T) {
+	mean, std := float32(0.5), float32(2)
+	plain := newTestPredictor(t, convBNInitNet, convReluPredictNet, PredictorOptions{DisableGraphOptimizations: true})
+	defer plain.Close()
+	normalizing := newTestPredictor(t, convBNInitNet, convReluPredictNet, PredictorOptions{
+		InputMean: []float32{mean},
+		InputStd:  []float32{std},
+	})
+	defer normalizing.Close()
+
+	_, passes := readTestOptimizationReport(t, normalizing)
+	if passes["fold_input_normalization"] != 1 {
+		t.Fatal("the input normalization was not folded")
+	}
+
+	normalized := make([]float32, len(convBNInput))
+	for ii, v := range convBNInput {
+		normalized[ii] = (v - mean) / std
+	}
+	want := predictOnce(t, plain, normalized, 1, 2, 2)
+	got := predictOnce(t, normalizing, convBNInput, 1, 2, 2)
+	assertClose(t, got, want)
+}
+
+func TestInputNormalizationRejectsLegacyPadding(t *testing.T) {
+	// SAME legacy padding pads the input even without pad arguments
+	predictNet := `
+name: "conv_same"
+external_input: "data"
+external_input: "conv_w"
+external_input: "conv_b"
+external_output: "prob"
+op {
+  input: "data" input: "conv_w" input: "conv_b"
+  output: "prob"
+  type: "Conv"
+  arg { name: "kernel" i: 1 }
+  arg { name: "legacy_pad" i: 2 }
+}
+`
+	pred, err := createTestPredictor(t, convBNInitNet, predictNet, PredictorOptions{
+		InputMean: []float32{0.5},
+	})
+	if err == nil {
+		pred.Close()
+		t.Fatal("the normalization was folded into a padded convolution")
+	}
+	if !strings.Contains(err.Error(), "pads its input") {
+		t.Fatalf("unexpected error %v", err)
+	}
+}
+
+func TestInputNormalizationRejectsChannelMismatch(t *testing.T) {
+	// the convolution reads a single channel
+	pred, err := createTestPredictor(t, convBNInitNet, convReluPredictNet, PredictorOptions{
+		InputMean: []float32{0.5, 0.5, 0.5},
+	})
+	if err == nil {
+		pred.Close()
+		t.Fatal("the normalization of three channels was folded into a convolution of one")
+	}
+	if !strings.Contains(err.Error(), "input channels") {
+		t.Fatalf("unexpected error %v", err)
+	}
+}
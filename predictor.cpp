@@ -1,10 +1,16 @@
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iosfwd>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <caffe2/core/blob_serialization.h>
 #include <caffe2/core/common.h>
 #include <caffe2/core/init.h>
 #include <caffe2/core/net.h>
@@ -18,12 +24,23 @@
 #include <caffe2/proto/caffe2.pb.h>
 
 #include <caffe2/core/tensor.h>
+#include <caffe2/utils/threadpool/ThreadPool.h>
 
 #ifdef WITH_CUDA
 #include <caffe2/core/context_gpu.h>
 #endif  // WITH_CUDA
 
+#include "allocator.impl.hpp"
+#include "deadline.impl.hpp"
+#include "executor.impl.hpp"
+#include "numa.impl.hpp"
+#include "optimizer.impl.hpp"
+#include "perf.impl.hpp"
 #include "predictor.hpp"
+#include "preemption.impl.hpp"
+#include "registry.impl.hpp"
+#include "roofline.impl.hpp"
+#include "threading.impl.hpp"
 #include "timer.h"
 #include "timer.impl.hpp"
 
@@ -37,25 +54,129 @@ static CUDAContext *cuda_context = nullptr;
 
 namespace mlmodelscope {
 
+// profile_control is shared by the profiling observers of the nets of a
+// predictor. The observers are attached once, when the nets are created,
+// and only record during a profiled run of their net or while the latency
+// histograms are enabled, so a run that is neither costs them two loads per
+// operator.
+struct profile_control {
+  // the profile of the last profiled run, published once the run is over.
+  // The readers hold a reference to the profile they use, so a run that
+  // ends meanwhile replaces it without freeing it from under them.
+  std::shared_ptr<profile> prof{nullptr};
+  std::string name{""}, metadata{""};
+  // whether every run is added to the histograms
+  std::atomic<bool> aggregating{false};
+  // whether the profiled operator runs read the hardware counters
+  std::atomic<bool> counting{false};
+  // the runs profiled by sampling, when it is enabled
+  profile_sampler sampler{};
+  op_histograms histograms{};
+
+  std::shared_ptr<profile> current() const { return std::atomic_load(&prof); }
+};
+
+// recording_profile is the profile of the operator run that the calling
+// thread records, null when it does not record one. It is set by the
+// operator observers, and every operator start overwrites it, so that one
+// left behind by an operator that failed does not outlive the next.
+static profile *&recording_profile() {
+  static thread_local profile *prof = nullptr;
+  return prof;
+}
+
+// memory_timeline records the allocations and frees of a predictor into
+// the profile of the operator run that the allocating (or freeing) thread
+// records, attributed to that operator
+class memory_timeline final : public allocation_observer {
+ public:
+  void allocated(size_t nbytes, int64_t live_bytes) override {
+    record(static_cast<int64_t>(nbytes), live_bytes);
+  }
+
+  void freed(size_t nbytes, int64_t live_bytes) override {
+    record(-static_cast<int64_t>(nbytes), live_bytes);
+  }
+
+ private:
+  void record(int64_t bytes, int64_t live_bytes) {
+    const auto prof = recording_profile();
+    if (prof != nullptr) {
+      prof->record_memory(now(), bytes, live_bytes,
+                          current_allocation_context().layer);
+    }
+  }
+};
+
+// recording_scope hands the profile of a run, null when it is not
+// profiled, to the observers of the nets of the state for the duration of
+// the run. An operator that failed on the calling thread may have left its
+// profile behind, it is cleared with the run.
+class recording_scope {
+ public:
+  recording_scope(std::atomic<profile *> *recording, profile *prof)
+      : recording_(recording) {
+    recording_->store(prof, std::memory_order_release);
+  }
+  ~recording_scope() {
+    recording_->store(nullptr, std::memory_order_release);
+    recording_profile() = nullptr;
+  }
+
+ private:
+  std::atomic<profile *> *recording_;
+};
+
+// shared_input_scope empties the input blob once the run is over, whatever
+// its outcome. Its tensor shares the memory of the caller, which must not
+// stay referenced after the call: cgo does not allow C to keep Go pointers
+// and the tensor scans would read freed memory.
+class shared_input_scope {
+ public:
+  explicit shared_input_scope(Blob *blob) : blob_(blob) {}
+  ~shared_input_scope() {
+    if (blob_ != nullptr) {
+      blob_->Reset();
+    }
+  }
+
+ private:
+  Blob *blob_;
+};
+
 template <class T>
 class TimeObserver final : public ObserverBase<T> {
  public:
-  explicit TimeObserver<T>(T *subject, profile **prof,
-                           std::string profile_name = "",
-                           std::string profile_metadata = "")
-      : ObserverBase<T>(subject),
-        prof_(prof),
-        profile_name_(profile_name),
-        profile_metadata_(profile_metadata) {}
+  explicit TimeObserver<T>(T *subject, profile_control *control,
+                           std::atomic<profile *> *run,
+                           const std::string &histograms,
+                           int layer_sequence_index = 0);
   ~TimeObserver() {}
 
-  void set_layer_sequence_index(int ii) { layer_sequence_index_ = ii; }
-
  private:
-  profile **prof_{nullptr};
-  profile_entry *entry_{nullptr};
-  std::string profile_name_{""}, profile_metadata_{""};
+  profile_control *control_{nullptr};
+  // the profile of the run in progress on the net, set by Run
+  std::atomic<profile *> *run_{nullptr};
   int layer_sequence_index_{0};  // this is not valid for net
+  // the profile and the start time of the run being recorded, and whether
+  // the run is added to the histogram. The run holds on to its profile
+  // until its net is done with it.
+  profile *recording_{nullptr};
+  bool aggregating_{false};
+  timestamp_t start_{};
+  latency_histogram *histogram_{nullptr};
+  // the interned name, metadata and input shapes of the operator. The
+  // shapes are re-interned only when the input dims change, which the
+  // signature (the rank then the dims of every input) tells without
+  // allocating.
+  uint32_t name_id_{0}, metadata_id_{0}, shapes_id_{0};
+  std::vector<int64_t> signature_{}, scratch_{};
+  // the estimated work of the operator, for the current input shapes
+  op_cost cost_{};
+  // the hardware counters at the start of the run being recorded, when
+  // counting is set
+  bool counting_{false};
+  perf_sample counters_{};
   // change overriding return type to void
   // to make it a covariant
   // TODO: check if it breaks anything?
@@ -63,79 +184,292 @@ class TimeObserver final : public ObserverBase<T> {
   void Stop() override;
 };
 
+template <>
+TimeObserver<NetBase>::TimeObserver(NetBase *subject,
+                                    profile_control *control,
+                                    std::atomic<profile *> *run,
+                                    const std::string &histograms,
+                                    int layer_sequence_index)
+    : ObserverBase<NetBase>(subject),
+      control_(control),
+      run_(run),
+      layer_sequence_index_(layer_sequence_index),
+      histogram_(control->histograms.net(histograms)) {}
+
 template <>
 void TimeObserver<NetBase>::Start() {
-  const auto net = this->subject();
-  auto net_name = net->Name();
-  if (net_name.empty()) {
-    net_name = profile_name_;
+  aggregating_ = control_->aggregating.load(std::memory_order_relaxed);
+  if (aggregating_) {
+    start_ = now();
   }
-  *this->prof_ = new profile(net_name, profile_metadata_);
-  int current_layer_sequence_index = 1;
-  for (auto *op : subject_->GetOperators()) {
-    auto obs = caffe2::make_unique<TimeObserver<OperatorBase>>(op, prof_);
-    obs->set_layer_sequence_index(current_layer_sequence_index);
-    op->AttachObserver(std::move(obs));
-    current_layer_sequence_index++;
+  recording_ = run_->load(std::memory_order_acquire);
+  if (recording_ != nullptr) {
+    recording_->start();
   }
-  const auto p = *this->prof_;
-  p->start();
 }
 
 template <>
 void TimeObserver<NetBase>::Stop() {
-  const auto p = *this->prof_;
-  p->end();
+  if (aggregating_) {
+    const auto ns = profile_clock::global().elapsed_ns(start_, now());
+    histogram_->add(static_cast<uint64_t>(ns));
+    aggregating_ = false;
+  }
+  if (recording_ != nullptr) {
+    recording_->end();
+    recording_ = nullptr;
+  }
 }
 
 template <>
-void TimeObserver<OperatorBase>::Start() {
-  const auto &op = this->subject();
+TimeObserver<OperatorBase>::TimeObserver(OperatorBase *subject,
+                                         profile_control *control,
+                                         std::atomic<profile *> *run,
+                                         const std::string &histograms,
+                                         int layer_sequence_index)
+    : ObserverBase<OperatorBase>(subject),
+      control_(control),
+      run_(run),
+      layer_sequence_index_(layer_sequence_index) {
   std::string name{""}, metadata{""};
-  if (op->has_debug_def()) {
-    const auto &opdef = op->debug_def();
+  if (subject->has_debug_def()) {
+    const auto &opdef = subject->debug_def();
     name = opdef.type();
     metadata = opdef.name();
   }
-  shapes_t shapes{};
-  for (const auto shape : op->InputTensorShapes()) {
-    std::vector<int> dims{};
-    for (const auto s : shape.dims()) {
-      dims.emplace_back(s);
+  name_id_ = profile_strings().intern(name);
+  metadata_id_ = profile_strings().intern(metadata);
+  shapes_id_ = profile_shapes().intern(shapes_t{});
+  histogram_ = control->histograms.get(histograms, layer_sequence_index, name,
+                                       metadata);
+}
+
+template <>
+void TimeObserver<OperatorBase>::Start() {
+  aggregating_ = control_->aggregating.load(std::memory_order_relaxed);
+  recording_ = run_->load(std::memory_order_acquire);
+  recording_profile() = recording_;
+  if (recording_ == nullptr) {
+    if (aggregating_) {
+      start_ = now();
+    }
+    return;
+  }
+  const auto &op = this->subject();
+  scratch_.clear();
+  for (int ii = 0; ii < op->InputSize(); ii++) {
+    const auto &blob = op->InputBlob(ii);
+    if (!BlobIsTensorType(blob, caffe2::CPU) &&
+        !BlobIsTensorType(blob, caffe2::CUDA)) {
+      scratch_.emplace_back(0);
+      continue;
+    }
+    const auto &tensor = blob.Get<Tensor>();
+    scratch_.emplace_back(tensor.ndim());
+    for (int jj = 0; jj < tensor.ndim(); jj++) {
+      scratch_.emplace_back(tensor.dim(jj));
+    }
+  }
+  if (scratch_ != signature_) {
+    shapes_t shapes{};
+    for (size_t ii = 0; ii < scratch_.size(); ii += scratch_[ii] + 1) {
+      shapes.emplace_back(scratch_.begin() + ii + 1,
+                          scratch_.begin() + ii + 1 + scratch_[ii]);
+    }
+    shapes_id_ = profile_shapes().intern(shapes);
+    signature_ = scratch_;
+    if (op->has_debug_def()) {
+      cost_ = estimate_op_cost(op->debug_def(), shapes);
     }
-    shapes.emplace_back(dims);
   }
-  this->entry_ =
-      new profile_entry(layer_sequence_index_, name, metadata, shapes);
+  current_allocation_context().layer = layer_sequence_index_;
+  counting_ = control_->counting.load(std::memory_order_relaxed) &&
+              perf_group::local().read(&counters_);
+  start_ = now();
 }
 
 template <>
 void TimeObserver<OperatorBase>::Stop() {
-  this->entry_->end();
-  const auto p = *this->prof_;
-  p->add(this->entry_);
+  if (recording_ == nullptr && !aggregating_) {
+    return;
+  }
+  const auto end = now();
+  perf_sample counters{};
+  const uint64_t *deltas = nullptr;
+  if (counting_ && perf_group::local().read(&counters)) {
+    counters = perf_delta(counters_, counters);
+    deltas = counters.counters;
+  }
+  counting_ = false;
+  if (aggregating_) {
+    const auto ns = profile_clock::global().elapsed_ns(start_, end);
+    histogram_->add(static_cast<uint64_t>(ns));
+    aggregating_ = false;
+  }
+  if (recording_ != nullptr) {
+    current_allocation_context().layer = -1;
+    recording_profile() = nullptr;
+    recording_->record(layer_sequence_index_, name_id_, metadata_id_,
+                       shapes_id_, start_, end, cost_.flops, cost_.bytes,
+                       deltas);
+    recording_ = nullptr;
+  }
 }
 
+// serialized_blobs_t holds (name, serialized blob) pairs
+using serialized_blobs_t = std::vector<std::pair<std::string, std::string>>;
+
+// model_state is the part of a predictor that a weight swap replaces: the
+// workspace holding the parameters and the net instantiated on it
+struct model_state {
+  ~model_state() { delete ws; }
+
+  // the arena outlives the workspace whose tensors it backs
+  std::unique_ptr<hugepage_arena> arena{nullptr};
+  Workspace *ws{nullptr};
+  NetBase *net{nullptr};
+  // the predict net as instantiated, after the load time rewrites
+  NetDef net_def;
+  std::vector<string> param_names{};
+  optimization_report report{};
+  // deadline and cancellation of the run in progress on net
+  run_control control{};
+  // profile of the run in progress on net, null when it is not profiled
+  std::atomic<profile *> recording{nullptr};
+  // nets computing a single blob, instantiated on first use
+  std::mutex partial_nets_mut{};
+  std::unordered_map<string, NetBase *> partial_nets{};
+};
+
+// model_session keeps the recurrent state of a sequence between
+// predictions. Its net runs in a child workspace of a model state, which
+// sees the parameters and holds the activations and the state blobs of the
+// session.
+struct model_session {
+  using clock_t = std::chrono::steady_clock;
+
+  // keeps the parameters the session started with alive across swaps, it
+  // is released after the child workspace
+  std::shared_ptr<model_state> parent{nullptr};
+  model_state local{};
+  // (state input, state output) blob names, the outputs are copied to the
+  // inputs after each step
+  std::vector<std::pair<string, string>> states{};
+  std::chrono::milliseconds ttl{0};
+  clock_t::time_point last_used{};
+  // serializes the steps of the session
+  std::mutex mut;
+  // output of the last step, the steps of different sessions may run
+  // concurrently so they do not use the predictor buffer
+  std::vector<float> output{};
+  int pred_len{0};
+};
+
+// run_request describes a prediction
+struct run_request {
+  float *input{nullptr};
+  int batch_size{0}, channels{0}, width{0}, height{0};
+  // the run is stopped once timeout_us have elapsed (0 for no deadline) or
+  // the token is cancelled
+  int64_t timeout_us{0};
+  cancel_token *token{nullptr};
+  // profile the run even if profiling is not enabled on the predictor
+  bool profile{false};
+  // set to the profile of the run when it is profiled, unless it is null
+  std::shared_ptr<::profile> *recorded{nullptr};
+  // destination of the output, the predictor buffer is used when it is
+  // null or too small
+  float *output{nullptr};
+  size_t output_nbytes{0};
+  // session the run is a step of, if any
+  model_session *session{nullptr};
+  // blob returned instead of the net output, only the operators it
+  // depends on are run
+  std::string output_blob{""};
+};
+
 class Predictor {
  public:
-  Predictor(NetDef *init_net, NetDef *net_def, DeviceKind device_kind);
-  void Predict(float *imageData, std::string input_type, const int batch_size,
-               const int channels, const int width, const int height);
+  // The parameters are either created by running init_net, or deserialized
+  // from params when init_net is null.
+  Predictor(NetDef *init_net, NetDef *net_def, DeviceKind device_kind,
+            const PredictorOptions &options,
+            const serialized_blobs_t *params = nullptr);
+  // the allocations outlive the predictor when their tensors are freed
+  // late, they must not reach its timeline then
+  ~Predictor() { allocations_->set_observer(nullptr); }
+  std::shared_ptr<model_state> Load(NetDef *init_net,
+                                    const serialized_blobs_t *params);
+  void SwapWeights(NetDef *init_net, const int iterations,
+                   const std::vector<std::vector<int>> &shapes,
+                   double *latencies);
+  void Run(model_state *state, float *imageData, const int batch_size,
+           const int channels, const int width, const int height,
+           profile *prof, int64_t timeout_us = 0,
+           cancel_token *token = nullptr, NetBase *net = nullptr);
+  NetBase *PartialNet(model_state *state, const std::string &output_blob);
+  float *Predict(const run_request &request);
+  float *PredictNow(const run_request &request, int64_t timeout_us);
+  int64_t NewSession(const std::vector<std::pair<string, string>> &states,
+                     int64_t ttl_ms);
+  std::shared_ptr<model_session> GetSession(int64_t id);
+  void DeleteSession(int64_t id);
+  json SessionsJson();
+  void Warmup(model_state *state, const int iterations,
+              const std::vector<std::vector<int>> &shapes, double *latencies);
+  json MeasureObserverOverhead(const int iterations,
+                               const std::vector<int> &shape);
+  std::vector<memory_range_t> TensorRanges(const model_state &state,
+                                           bool parameters);
+  int64_t TensorBytes(bool parameters);
+  void Spill(const std::string &path);
+
+  // State returns the live model state. Runs hold on to the state they
+  // started with, so a swap does not pull the weights from under them.
+  std::shared_ptr<model_state> State() const {
+    return std::atomic_load(&state_);
+  }
 
   DeviceKind device_kind_;
 
-  Workspace *ws_{nullptr};
-  NetBase *net_;
+  std::shared_ptr<model_state> state_{nullptr};
   std::vector<string> input_names_;
   std::vector<string> output_names_;
   int pred_len_;
   void *result_{nullptr};
   bool profile_enabled_{false};
-  profile *prof_{nullptr};
+  profile_control profiling_{};
+  memory_timeline memory_timeline_{};
 
   caffe2::onnx::Caffe2BackendRep *onnx_backend_;
 
-  std::string profile_name_{""}, profile_metadata_{""};
+  // the predict net before the load time rewrites, and the options they
+  // are applied with, which every weight swap reuses
+  NetDef source_net_def_;
+  // whether source_net_def_ already went through the rewrites, as the net
+  // of a spill did, in which case weights from an init net cannot be
+  // swapped in since they were not rewritten with it
+  bool rewritten_source_{false};
+  bool optimize_graph_{true};
+  std::vector<float> input_mean_{}, input_std_{};
+  bool huge_pages_{false}, lock_memory_{false};
+  // serializes the weight swaps
+  std::mutex swap_mut_;
+
+  std::mutex sessions_mut_;
+  std::unordered_map<int64_t, std::shared_ptr<model_session>> sessions_{};
+  int64_t next_session_id_{1};
+  int64_t sessions_created_{0}, sessions_expired_{0};
+
+  thread_config threading_{};
+  int numa_node_{-1};
+  Priority priority_{NORMAL_PRIORITY};
+  // the runs submitted to the process wide executor
+  std::shared_ptr<model_queue> queue_{nullptr};
+  std::shared_ptr<allocation_tracker> allocations_{
+      std::make_shared<allocation_tracker>()};
+  size_t result_nbytes_{0};
+
 };
 }
 
@@ -193,64 +527,375 @@ static void set_operator_engine(NetDef *net, DeviceKind device_kind) {
   set_operator_engine(net,  get_backend("eigen") , caffe2::CPU);
 }
 
+static void set_numa_node(NetDef *net, int numa_node) {
+  net->mutable_device_option()->set_numa_node_id(numa_node);
+  for (int i = 0; i < net->op_size(); i++) {
+    net->mutable_op(i)->mutable_device_option()->set_numa_node_id(numa_node);
+  }
+}
+
 mlmodelscope::Predictor::Predictor(NetDef *init_net, NetDef *pred_net_def,
-                     DeviceKind device_kind) {
-  ws_ = new Workspace();
+                                   DeviceKind device_kind,
+                                   const PredictorOptions &options,
+                                   const serialized_blobs_t *params) {
+  predictor_allocator::install();
   device_kind_ = device_kind;
-  ws_->RunNetOnce(*init_net);
+  std::vector<int> cpus{};
+  if (options.cpus != nullptr && options.num_cpus > 0) {
+    cpus.assign(options.cpus, options.cpus + options.num_cpus);
+  }
+  if (options.numa_node >= 0) {
+#ifndef __linux__
+    throw std::invalid_argument("numa placement is only supported on linux");
+#endif  // __linux__
+    numa_node_ = options.numa_node;
+    const auto node_cpus = numa_node_cpus(numa_node_);
+    if (cpus.empty()) {
+      cpus = node_cpus;
+    } else {
+      cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                [&](int cpu) {
+                                  return std::find(node_cpus.begin(),
+                                                   node_cpus.end(),
+                                                   cpu) == node_cpus.end();
+                                }),
+                 cpus.end());
+      if (cpus.empty()) {
+        throw std::invalid_argument(
+            "none of the requested cpus belong to the numa node");
+      }
+    }
+    set_numa_node(pred_net_def, numa_node_);
+  }
+  threading_ = thread_config(options.num_threads, cpus.data(), cpus.size());
+
+  if (options.input_mean != nullptr) {
+    if (device_kind == CUDA_DEVICE_KIND) {
+      throw std::invalid_argument(
+          "input normalization folding is only supported on the CPU");
+    }
+    // the fold checks the channels against the ones of the convolution
+    const auto channels = options.input_channels;
+    if (channels <= 0) {
+      throw std::invalid_argument(
+          "the input normalization needs a positive number of channels");
+    }
+    input_mean_.assign(options.input_mean, options.input_mean + channels);
+    input_std_.assign(channels, 1.0f);
+    if (options.input_std != nullptr) {
+      input_std_.assign(options.input_std, options.input_std + channels);
+    }
+  }
+  if (options.priority != NORMAL_PRIORITY &&
+      options.priority != LOW_PRIORITY && options.priority != HIGH_PRIORITY) {
+    throw std::invalid_argument("invalid priority");
+  }
+  priority_ = options.priority;
+  if (options.weight < 0) {
+    throw std::invalid_argument("the executor weight must be positive");
+  }
+  queue_ = std::make_shared<model_queue>(priority_, options.weight);
+  optimize_graph_ = options.optimize_graph != 0;
+  huge_pages_ = options.huge_pages != 0;
+  lock_memory_ = options.lock_memory != 0;
 
   for (auto in : pred_net_def->external_input()) {
-	  auto* blob = ws_->GetBlob(in);
-	  if (!blob) {
-		  ws_->CreateBlob(in);
-	  }
     input_names_.emplace_back(in);
   }
-  for (auto  out: pred_net_def->external_output()) {
-	  auto* blob = ws_->GetBlob(out);
-	  if (!blob) {
-		  ws_->CreateBlob(out);
-	  }
+  for (auto out : pred_net_def->external_output()) {
     output_names_.emplace_back(out);
   }
-
   if (!pred_net_def->has_name()) {
     pred_net_def->set_name("go-caffe2");
   }
-  net_ = ws_->CreateNet(*pred_net_def);
+  source_net_def_.CopyFrom(*pred_net_def);
+  rewritten_source_ = params != nullptr;
+
+  state_ = Load(init_net, params);
+  allocations_->set_observer(&memory_timeline_);
 }
 
-void mlmodelscope::Predictor::Predict(float *imageData, std::string input_type,
-                        const int batch_size, const int channels,
-                        const int width, const int height) {
-    using mlmodelscope::TimeObserver;
-  if (result_ != nullptr) {
-    free(result_);
-    result_ = nullptr;
+// instantiate_net creates a net in the workspace of the state, with the
+// run control checks and the profiling observers attached to it. The
+// observers stay attached for the lifetime of the net, and aggregate the
+// latencies into the histograms named histograms.
+static NetBase *instantiate_net(mlmodelscope::model_state *state,
+                                const NetDef &net_def,
+                                mlmodelscope::profile_control *profiling,
+                                const std::string &histograms) {
+  using mlmodelscope::TimeObserver;
+  auto net = state->ws->CreateNet(net_def);
+  net->AttachObserver(caffe2::make_unique<TimeObserver<NetBase>>(
+      net, profiling, &state->recording, histograms));
+  // the operators are numbered from 1, as they always were in the profiles
+  int layer_sequence_index = 1;
+  for (auto op : net->GetOperators()) {
+    op->AttachObserver(caffe2::make_unique<mlmodelscope::deadline_observer>(
+        op, &state->control));
+    op->AttachObserver(caffe2::make_unique<TimeObserver<OperatorBase>>(
+        op, profiling, &state->recording, histograms,
+        layer_sequence_index++));
+  }
+  return net;
+}
+
+// Load creates the parameters in a new workspace and instantiates the
+// predict net on them, applying the load time rewrites.
+std::shared_ptr<mlmodelscope::model_state> mlmodelscope::Predictor::Load(
+    NetDef *init_net, const serialized_blobs_t *params) {
+  auto state = std::make_shared<model_state>();
+  if (huge_pages_) {
+    state->arena.reset(new hugepage_arena(lock_memory_));
+  }
+  state->ws = new Workspace();
+  auto ws = state->ws;
+  if (init_net != nullptr && numa_node_ >= 0) {
+    set_numa_node(init_net, numa_node_);
+  }
+  NetDef pred_net_def;
+  pred_net_def.CopyFrom(source_net_def_);
+
+  thread_scope scope(threading_);
+  numa_scope numa(numa_node_);
+  allocation_scope allocations(state->arena.get(), allocations_);
+  if (threading_.num_threads() > 0) {
+    // the workspace pool is created here so that its workers inherit the
+    // affinity of the scope
+    ws->GetThreadPool()->setNumThreads(threading_.num_threads());
+    pred_net_def.set_num_workers(threading_.num_threads());
+  }
+  if (init_net != nullptr) {
+    ws->RunNetOnce(*init_net);
+  } else if (params != nullptr) {
+    for (const auto &param : *params) {
+      DeserializeBlob(param.second, ws->CreateBlob(param.first));
+    }
+  }
+  state->param_names = ws->Blobs();
+  if (numa_node_ >= 0 && device_kind_ == CPU_DEVICE_KIND) {
+    // pages the init net reused from the process heap may live elsewhere
+    numa_migrate(TensorRanges(*state, true), numa_node_, true);
+  }
+
+  for (const auto &name : input_names_) {
+    if (ws->GetBlob(name) == nullptr) {
+      ws->CreateBlob(name);
+    }
+  }
+  for (const auto &name : output_names_) {
+    if (ws->GetBlob(name) == nullptr) {
+      ws->CreateBlob(name);
+    }
+  }
+
+  const auto blobs_before_rewrites = ws->Blobs();
+  // the normalization is folded into the first convolution before the
+  // fusions turn it into another operator
+  if (!input_mean_.empty()) {
+    fold_input_normalization(&pred_net_def, ws, input_names_[0], input_mean_,
+                             input_std_, &state->report);
+  }
+  if (optimize_graph_) {
+    optimize_net(&pred_net_def, ws,
+                 device_kind_ == CUDA_DEVICE_KIND ? caffe2::CUDA : caffe2::CPU,
+                 &state->report);
+  } else {
+    state->report.set_op_counts(pred_net_def.op_size(),
+                                pred_net_def.op_size());
+  }
+  // the rewrites may have created parameters (e.g. convolution biases)
+  for (const auto &name : ws->Blobs()) {
+    if (std::find(blobs_before_rewrites.begin(), blobs_before_rewrites.end(),
+                  name) == blobs_before_rewrites.end()) {
+      state->param_names.emplace_back(name);
+    }
+  }
+  state->net_def.CopyFrom(pred_net_def);
+  state->net = instantiate_net(state.get(), pred_net_def, &profiling_,
+                               pred_net_def.name());
+  return state;
+}
+
+// SwapWeights loads the parameters of init_net next to the live ones,
+// warms the new state up with the given shapes, then makes it live. Runs
+// that already started finish on the previous weights, which are released
+// by the last of them.
+void mlmodelscope::Predictor::SwapWeights(
+    NetDef *init_net, const int iterations,
+    const std::vector<std::vector<int>> &shapes, double *latencies) {
+  if (rewritten_source_) {
+    throw std::invalid_argument(
+        "cannot swap the weights of a predictor loaded from a spill");
+  }
+  std::lock_guard<std::mutex> lock(swap_mut_);
+  auto staged = Load(init_net, nullptr);
+  if (iterations > 0 && !shapes.empty()) {
+    Warmup(staged.get(), iterations, shapes, latencies);
+  }
+  std::atomic_store(&state_, staged);
+}
+
+static const char spill_magic[8] = {'C', '2', 'S', 'P', 'I', 'L', 'L', '1'};
+
+static void write_spill_string(std::ofstream &file, const std::string &s) {
+  const uint64_t size = s.size();
+  file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  file.write(s.data(), s.size());
+}
+
+static std::string read_spill_string(std::ifstream &file) {
+  uint64_t size = 0;
+  file.read(reinterpret_cast<char *>(&size), sizeof(size));
+  if (!file) {
+    throw std::runtime_error("truncated spill file");
+  }
+  std::string s(size, '\0');
+  file.read(&s[0], size);
+  if (!file) {
+    throw std::runtime_error("truncated spill file");
+  }
+  return s;
+}
+
+// Spill writes the instantiated predict net and the serialized parameters
+// to path. The file is written next to path and renamed so that a reader
+// never sees a partial spill.
+void mlmodelscope::Predictor::Spill(const std::string &path) {
+  const auto state = State();
+  const auto tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      throw std::runtime_error("cannot create spill file " + tmp_path);
+    }
+    file.write(spill_magic, sizeof(spill_magic));
+    std::string net;
+    state->net_def.SerializeToString(&net);
+    write_spill_string(file, net);
+    std::vector<std::pair<std::string, const Blob *>> params{};
+    for (const auto &name : state->param_names) {
+      const auto blob = state->ws->GetBlob(name);
+      if (blob != nullptr && (BlobIsTensorType(*blob, caffe2::CPU) ||
+                              BlobIsTensorType(*blob, caffe2::CUDA))) {
+        params.emplace_back(name, blob);
+      }
+    }
+    const uint64_t num_params = params.size();
+    file.write(reinterpret_cast<const char *>(&num_params), sizeof(num_params));
+    for (const auto &param : params) {
+      write_spill_string(file, param.first);
+      write_spill_string(file, SerializeBlob(*param.second, param.first));
+    }
+    if (!file) {
+      throw std::runtime_error("cannot write spill file " + tmp_path);
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("cannot rename spill file to " + path);
+  }
+}
+
+std::vector<mlmodelscope::memory_range_t> mlmodelscope::Predictor::TensorRanges(
+    const model_state &state, bool parameters) {
+  const auto &param_names = state.param_names;
+  std::vector<memory_range_t> ranges{};
+  for (const auto &name : state.ws->Blobs()) {
+    const auto is_param = std::find(param_names.begin(), param_names.end(),
+                                    name) != param_names.end();
+    if (is_param != parameters) {
+      continue;
+    }
+    const auto blob = state.ws->GetBlob(name);
+    if (blob == nullptr || !BlobIsTensorType(*blob, caffe2::CPU)) {
+      continue;
+    }
+    const auto &tensor = blob->Get<TensorCPU>();
+    if (tensor.nbytes() == 0) {
+      continue;
+    }
+    ranges.emplace_back(tensor.raw_data(), tensor.nbytes());
   }
-  if (profile_enabled_) {
-    auto net_ob = make_unique<TimeObserver<NetBase>>(
-        net_, &prof_, profile_name_, profile_metadata_);
-    net_->AttachObserver(std::move(net_ob));
+  return ranges;
+}
+
+// TensorBytes sums the bytes of the parameter (or activation) tensors at
+// their current shape. The net inputs are not counted since they share the
+// memory of the caller.
+int64_t mlmodelscope::Predictor::TensorBytes(bool parameters) {
+  const auto state = State();
+  const auto &param_names = state->param_names;
+  int64_t total = 0;
+  for (const auto &name : state->ws->Blobs()) {
+    const auto is_param = std::find(param_names.begin(), param_names.end(),
+                                    name) != param_names.end();
+    const auto is_input = std::find(input_names_.begin(), input_names_.end(),
+                                    name) != input_names_.end();
+    if (is_param != parameters || (!is_param && is_input)) {
+      continue;
+    }
+    const auto blob = state->ws->GetBlob(name);
+    if (blob == nullptr || !(BlobIsTensorType(*blob, caffe2::CPU) ||
+                             BlobIsTensorType(*blob, caffe2::CUDA))) {
+      continue;
+    }
+    total += blob->Get<Tensor>().nbytes();
   }
+  return total;
+}
 
-  const auto data_size = batch_size * channels * width * height;
+// PartialNet returns the net of state that only runs the operators
+// output_blob depends on. The nets are cached per state, the parameters
+// they read are the ones of the full net.
+NetBase *mlmodelscope::Predictor::PartialNet(model_state *state,
+                                             const std::string &output_blob) {
+  std::lock_guard<std::mutex> lock(state->partial_nets_mut);
+  const auto it = state->partial_nets.find(output_blob);
+  if (it != state->partial_nets.end()) {
+    return it->second;
+  }
+  const auto net_def = prune_net(state->net_def, output_blob);
+  thread_scope scope(threading_);
+  numa_scope numa(numa_node_);
+  allocation_scope allocations(state->arena.get(), allocations_);
+  auto net = instantiate_net(state, net_def, &profiling_, net_def.name());
+  state->partial_nets[output_blob] = net;
+  return net;
+}
 
-  std::vector<float> data(data_size);
-  std::copy(imageData, imageData + data_size, data.begin());
+// Run feeds the input to the net of state and runs it, recording it into
+// prof unless it is null. The run is stopped between operators, with a
+// run_aborted exception, once timeout_us have elapsed or the token is
+// cancelled.
+void mlmodelscope::Predictor::Run(model_state *state, float *imageData,
+                                  const int batch_size, const int channels,
+                                  const int width, const int height,
+                                  profile *prof, int64_t timeout_us,
+                                  cancel_token *token, NetBase *net) {
+  if (net == nullptr) {
+    net = state->net;
+  }
+  thread_scope scope(threading_);
+  numa_scope numa(numa_node_);
+  allocation_scope allocations(state->arena.get(), allocations_);
 
+  // the input is only read during the run, the tensor shares the memory of
+  // the caller instead of copying it
   std::vector<int64_t> dims({batch_size, channels, width, height});
 
   auto input_name = input_names_[0];
-  auto *blob = ws_->GetBlob(input_name);
+  auto *blob = state->ws->GetBlob(input_name);
   if (blob == nullptr) {
-    blob = ws_->CreateBlob(input_name);
+    blob = state->ws->CreateBlob(input_name);
   }
+  // the cuda tensor is a copy
+  shared_input_scope input_scope(device_kind_ == CUDA_DEVICE_KIND ? nullptr
+                                                                  : blob);
 
   if (device_kind_ == CUDA_DEVICE_KIND) {
 #ifdef WITH_CUDA
     Tensor cpu_tensor(dims, caffe2::CPU);
-    cpu_tensor.ShareExternalPointer(data.data());
+    cpu_tensor.ShareExternalPointer(imageData);
     auto tensor = BlobGetMutableTensor(blob, caffe2::CUDA);
     tensor->CopyFrom(cpu_tensor);
 #else
@@ -260,42 +905,419 @@ void mlmodelscope::Predictor::Predict(float *imageData, std::string input_type,
   } else {
     auto tensor = BlobGetMutableTensor(blob, caffe2::CPU);
     tensor->Resize(dims);
-    tensor->ShareExternalPointer(data.data());
+    tensor->ShareExternalPointer(imageData);
   }
 
-  if (!net_->Run()) {
+  recording_scope recording(&state->recording, prof);
+  auto &control = state->control;
+  control.arm(timeout_us, token, priority_ == LOW_PRIORITY);
+  bool ok = false;
+  try {
+    ok = net->Run();
+  } catch (...) {
+    control.disarm();
+    if (control.aborted() != success) {
+      throw run_aborted(control.aborted());
+    }
+    throw;
+  }
+  control.disarm();
+  if (control.aborted() != success) {
+    throw run_aborted(control.aborted());
+  }
+  if (!ok) {
     throw std::runtime_error("invalid run");
   }
+}
+
+// Predict runs the prediction on the calling thread, or on the process wide
+// executor once it is started. In the latter case the timeout includes the
+// time the run spent queued. It returns where the output was written.
+float *mlmodelscope::Predictor::Predict(const run_request &request) {
+  auto &executor = run_executor::global();
+  if (!executor.started()) {
+    return PredictNow(request, request.timeout_us);
+  }
+  const auto submitted = std::chrono::steady_clock::now();
+  float *output = nullptr;
+  executor.run(queue_, [&] {
+    auto remaining_us = request.timeout_us;
+    if (request.timeout_us > 0) {
+      remaining_us -= std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - submitted)
+                          .count();
+      if (remaining_us <= 0) {
+        throw run_aborted(error_deadline_exceeded);
+      }
+    }
+    if (request.token != nullptr && request.token->cancelled) {
+      throw run_aborted(error_cancelled);
+    }
+    output = PredictNow(request, remaining_us);
+  });
+  return output;
+}
+
+float *mlmodelscope::Predictor::PredictNow(const run_request &request,
+                                           int64_t timeout_us) {
+  const auto state = State();
+  preemption_scope preemption(priority_ == HIGH_PRIORITY);
+  allocations_->reset_peak();
+  if (request.session == nullptr && result_ != nullptr) {
+    free(result_);
+    result_ = nullptr;
+    result_nbytes_ = 0;
+  }
+  auto target = request.session != nullptr ? &request.session->local
+                                           : state.get();
+  NetBase *net = nullptr;
+  if (!request.output_blob.empty()) {
+    if (request.session != nullptr) {
+      throw std::invalid_argument(
+          "sessions do not support partial execution");
+    }
+    net = PartialNet(target, request.output_blob);
+  }
+  const auto batch_size = request.batch_size;
+  const auto profiled = profile_enabled_ || request.profile;
+  bool sampled_by_rate = false;
+  const auto sampled =
+      !profiled && profiling_.sampler.should_profile(&sampled_by_rate);
+  // the profile belongs to this run, it is published as the last profiled
+  // run once the run is over
+  std::shared_ptr<profile> prof{nullptr};
+  if (profiled || sampled) {
+    auto name = (net != nullptr ? net : target->net)->Name();
+    if (name.empty()) {
+      name = profiling_.name;
+    }
+    prof = std::make_shared<profile>(name, profiling_.metadata);
+    if (request.recorded != nullptr) {
+      *request.recorded = prof;
+    }
+  }
+  const auto start = now();
+  try {
+    Run(target, request.input, batch_size, request.channels, request.width,
+        request.height, prof.get(), timeout_us, request.token, net);
+  } catch (const run_aborted &) {
+    // the runs cut by their deadline are the ones worth looking at. The
+    // net did not stop the profile, which is kept as far as it got.
+    if (prof != nullptr) {
+      prof->end();
+      std::atomic_store(&profiling_.prof, prof);
+      if (sampled) {
+        profiling_.sampler.offer(prof.get(), elapsed_time(start, now()),
+                                 sampled_by_rate, true);
+      }
+    }
+    throw;
+  }
+  if (prof != nullptr) {
+    std::atomic_store(&profiling_.prof, prof);
+    if (sampled) {
+      profiling_.sampler.offer(prof.get(), elapsed_time(start, now()),
+                               sampled_by_rate);
+    }
+  }
+  if (request.session != nullptr) {
+    // carry the recurrent state over to the next step
+    const auto device =
+        device_kind_ == CUDA_DEVICE_KIND ? caffe2::CUDA : caffe2::CPU;
+    for (const auto &names : request.session->states) {
+      const auto from = target->ws->GetBlob(names.second);
+      if (from == nullptr || !BlobIsTensorType(*from, device)) {
+        throw std::runtime_error("state blob " + names.second +
+                                 " was not produced");
+      }
+      BlobGetMutableTensor(target->ws->GetBlob(names.first), device)
+          ->CopyFrom(from->Get<Tensor>());
+    }
+  }
 
-  auto output_name = output_names_[0];
-  auto *output_blob = ws_->GetBlob(output_name);
+  const auto output_name =
+      net != nullptr ? request.output_blob : output_names_[0];
+  auto *output_blob = target->ws->GetBlob(output_name);
   if (output_blob == nullptr) {
     throw std::runtime_error("output blob does not exist");
   }
 
+  auto &pred_len =
+      request.session != nullptr ? request.session->pred_len : pred_len_;
+  const auto output_buffer = [&](size_t nbytes) -> void * {
+    if (request.output != nullptr && nbytes <= request.output_nbytes) {
+      return request.output;
+    }
+    if (request.session != nullptr) {
+      request.session->output.resize(nbytes / sizeof(float));
+      return request.session->output.data();
+    }
+    result_ = (void *)malloc(nbytes);
+    result_nbytes_ = nbytes;
+    return result_;
+  };
+
   if (device_kind_ == CUDA_DEVICE_KIND) {
 #ifdef WITH_CUDA
     auto output_tensor = output_blob->Get<caffe2::TensorCUDA>();
-    result_ = (void *)malloc(output_tensor.nbytes());
-    pred_len_ = output_tensor.size() / batch_size;
+    auto output = output_buffer(output_tensor.nbytes());
+    pred_len = output_tensor.size() / batch_size;
     cuda_context->CopyBytesToCPU(output_tensor.nbytes(),
-                                 output_tensor.raw_data(), result_);
+                                 output_tensor.raw_data(), output);
     cuda_context->FinishDeviceComputation();
-    return;
+    return (float *)output;
 #else
     throw std::runtime_error(
         "ERROR: go-caffe2 was compiled with nogpu tag set");
 #endif  // WITH_CUDA
   } else {
     auto output_tensor = output_blob->Get<TensorCPU>();
-    pred_len_ = output_tensor.size() / batch_size;
-    result_ = (void *)malloc(output_tensor.nbytes());
-    memcpy(result_, output_tensor.raw_data(), output_tensor.nbytes());
+    pred_len = output_tensor.size() / batch_size;
+    auto output = output_buffer(output_tensor.nbytes());
+    memcpy(output, output_tensor.raw_data(), output_tensor.nbytes());
+    return (float *)output;
+  }
+}
+
+// NewSession creates a session whose state blobs start from the values
+// they have in the model workspace, if any. Sessions that are not used for
+// ttl_ms (when positive) are deleted.
+int64_t mlmodelscope::Predictor::NewSession(
+    const std::vector<std::pair<string, string>> &states, int64_t ttl_ms) {
+  auto session = std::make_shared<model_session>();
+  session->parent = State();
+  session->states = states;
+  session->ttl = std::chrono::milliseconds(ttl_ms);
+  session->last_used = model_session::clock_t::now();
+  const auto &parent = *session->parent;
+  auto &local = session->local;
+
+  std::lock_guard<std::mutex> lock(sessions_mut_);
+  const auto id = next_session_id_++;
+  local.net_def.CopyFrom(parent.net_def);
+  local.net_def.set_name(parent.net_def.name() + "_session_" +
+                         std::to_string(id));
+
+  thread_scope scope(threading_);
+  numa_scope numa(numa_node_);
+  allocation_scope allocations(parent.arena.get(), allocations_);
+  local.ws = new Workspace(parent.ws);
+  // everything but the parameters is local to the session, a blob created
+  // in a child workspace would otherwise resolve to the one of the parent
+  const auto is_param = [&](const string &name) {
+    return std::find(parent.param_names.begin(), parent.param_names.end(),
+                     name) != parent.param_names.end();
+  };
+  for (const auto &name : input_names_) {
+    if (!is_param(name)) {
+      local.ws->CreateLocalBlob(name);
+    }
+  }
+  for (const auto &op : local.net_def.op()) {
+    for (const auto &name : op.output()) {
+      if (!is_param(name)) {
+        local.ws->CreateLocalBlob(name);
+      }
+    }
+  }
+  for (const auto &names : states) {
+    if (std::find(input_names_.begin(), input_names_.end(), names.first) ==
+        input_names_.end()) {
+      throw std::invalid_argument(names.first + " is not an input of the net");
+    }
+    if (local.ws->GetBlob(names.second) == nullptr) {
+      throw std::invalid_argument(names.second + " is not produced by the net");
+    }
+    const auto initial = parent.ws->GetBlob(names.first);
+    const auto device =
+        device_kind_ == CUDA_DEVICE_KIND ? caffe2::CUDA : caffe2::CPU;
+    if (initial != nullptr && BlobIsTensorType(*initial, device)) {
+      BlobGetMutableTensor(local.ws->CreateLocalBlob(names.first), device)
+          ->CopyFrom(initial->Get<Tensor>());
+    }
+  }
+  // the sessions run the operators of the net, so their latencies go to
+  // the histograms of the net rather than to ones per session
+  local.net = instantiate_net(&local, local.net_def, &profiling_,
+                              parent.net_def.name());
+
+  sessions_[id] = session;
+  sessions_created_++;
+  return id;
+}
+
+std::shared_ptr<mlmodelscope::model_session>
+mlmodelscope::Predictor::GetSession(int64_t id) {
+  std::lock_guard<std::mutex> lock(sessions_mut_);
+  const auto now = model_session::clock_t::now();
+  for (auto it = sessions_.begin(); it != sessions_.end();) {
+    const auto &session = it->second;
+    if (it->first != id && session->ttl.count() > 0 &&
+        now - session->last_used > session->ttl) {
+      it = sessions_.erase(it);
+      sessions_expired_++;
+    } else {
+      ++it;
+    }
+  }
+  const auto it = sessions_.find(id);
+  if (it == sessions_.end()) {
+    throw std::invalid_argument("session " + std::to_string(id) +
+                                " does not exist or expired");
+  }
+  it->second->last_used = now;
+  return it->second;
+}
+
+void mlmodelscope::Predictor::DeleteSession(int64_t id) {
+  std::lock_guard<std::mutex> lock(sessions_mut_);
+  if (sessions_.erase(id) == 0) {
+    throw std::invalid_argument("session " + std::to_string(id) +
+                                " does not exist or expired");
+  }
+}
+
+json mlmodelscope::Predictor::SessionsJson() {
+  std::lock_guard<std::mutex> lock(sessions_mut_);
+  return json{
+      {"active", sessions_.size()},
+      {"created", sessions_created_},
+      {"expired", sessions_expired_},
+  };
+}
+
+// Warmup runs `iterations` synthetic predictions for every input shape so
+// that activation buffers are allocated and faulted in, and the engines are
+// initialized, before the predictor serves traffic. Shapes are run from the
+// largest to the smallest so that the buffers sized by the largest shape are
+// reused by the others. The latency of each run (in milliseconds) is written
+// to latencies[shape_index * iterations + iteration] when latencies is not
+// null. The runs are not profiled.
+void mlmodelscope::Predictor::Warmup(
+    model_state *state, const int iterations,
+    const std::vector<std::vector<int>> &shapes, double *latencies) {
+  std::vector<size_t> order(shapes.size());
+  for (size_t ii = 0; ii < order.size(); ii++) {
+    order[ii] = ii;
+  }
+  const auto shape_size = [&](size_t ii) {
+    return static_cast<int64_t>(shapes[ii][0]) * shapes[ii][1] *
+           shapes[ii][2] * shapes[ii][3];
+  };
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return shape_size(a) > shape_size(b);
+  });
+
+  std::vector<float> data(shape_size(order[0]));
+  for (size_t ii = 0; ii < data.size(); ii++) {
+    data[ii] = static_cast<float>(ii % 255) / 255.0f;
+  }
+
+  for (const auto shape_index : order) {
+    const auto &shape = shapes[shape_index];
+    for (int ii = 0; ii < iterations; ii++) {
+      const auto start = now();
+      Run(state, data.data(), shape[0], shape[1], shape[2], shape[3],
+          nullptr);
+      if (latencies != nullptr) {
+        latencies[shape_index * iterations + ii] = elapsed_time(start, now());
+      }
+    }
+  }
+}
+
+
+// MeasureObserverOverhead compares the latency of the net, with its
+// profiling observers attached but not recording, to the one of a copy of
+// the net without them. The copy keeps the run control checks, which every
+// run pays for, so that only the profiling observers are measured. The two
+// nets run alternately on the same synthetic
+// input, so that both see the same cache and frequency conditions, and the
+// median latencies are reported.
+json mlmodelscope::Predictor::MeasureObserverOverhead(
+    const int iterations, const std::vector<int> &shape) {
+  auto state = State();
+  NetDef net_def;
+  net_def.CopyFrom(state->net_def);
+  net_def.set_name(state->net->Name() + "_unobserved");
+  NetBase *unobserved = nullptr;
+  {
+    thread_scope scope(threading_);
+    numa_scope numa(numa_node_);
+    allocation_scope allocations(state->arena.get(), allocations_);
+    unobserved = state->ws->CreateNet(net_def, true);
+  }
+  if (unobserved == nullptr) {
+    throw std::runtime_error("unable to create the unobserved net");
+  }
+  for (auto op : unobserved->GetOperators()) {
+    op->AttachObserver(caffe2::make_unique<deadline_observer>(
+        op, &state->control));
+  }
+
+  std::vector<float> data(static_cast<int64_t>(shape[0]) * shape[1] *
+                          shape[2] * shape[3]);
+  for (size_t ii = 0; ii < data.size(); ii++) {
+    data[ii] = static_cast<float>(ii % 255) / 255.0f;
+  }
+  const auto run = [&](NetBase *net) {
+    const auto start = now();
+    Run(state.get(), data.data(), shape[0], shape[1], shape[2], shape[3],
+        nullptr, 0, nullptr, net);
+    return elapsed_time(start, now());
+  };
+  const auto median = [](std::vector<double> &v) {
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+  };
+
+  std::vector<double> observed{}, bare{};
+  try {
+    // the first runs size the activations of both nets
+    run(state->net);
+    run(unobserved);
+    for (int ii = 0; ii < iterations; ii++) {
+      observed.emplace_back(run(state->net));
+      bare.emplace_back(run(unobserved));
+    }
+  } catch (...) {
+    state->ws->DeleteNet(net_def.name());
+    throw;
+  }
+  state->ws->DeleteNet(net_def.name());
+
+  const auto ops = state->net->GetOperators().size();
+  const auto observed_ms = median(observed), unobserved_ms = median(bare);
+  return json{
+      {"iterations", iterations},
+      {"ops", ops},
+      {"observed_ms", observed_ms},
+      {"unobserved_ms", unobserved_ms},
+      {"overhead_ms", observed_ms - unobserved_ms},
+      {"overhead_per_op_ns",
+       ops == 0 ? 0.0 : (observed_ms - unobserved_ms) * 1.0e6 / ops},
+  };
+}
+
+PredictorOptions DefaultPredictorOptionsCaffe2() {
+  PredictorOptions options;
+  memset(&options, 0, sizeof(options));
+  options.optimize_graph = 1;
+  options.numa_node = -1;
+  return options;
+}
+
+// report_error hands the reason a predictor could not be created to the
+// caller of the constructors
+static void report_error(char **error, const std::exception &ex) {
+  if (error != nullptr) {
+    *error = strdup(ex.what());
   }
 }
 
 PredictorContext NewCaffe2(char *init_net_file, char *pred_net_file,
-                           DeviceKind device_kind) {
+                           DeviceKind device_kind,
+                           const PredictorOptions *options, char **error) {
   try {
     NetDef init_net, pred_net;
     if (!ReadProtoFromFile(init_net_file, &init_net)) {
@@ -306,21 +1328,27 @@ PredictorContext NewCaffe2(char *init_net_file, char *pred_net_file,
       throw std::runtime_error("cannot read pred net file");
     }
     set_operator_engine(&pred_net, device_kind);
-    auto ctx = new mlmodelscope::Predictor(&init_net, &pred_net, device_kind);
+    auto ctx = new mlmodelscope::Predictor(
+        &init_net, &pred_net, device_kind,
+        options == nullptr ? DefaultPredictorOptionsCaffe2() : *options);
     return (PredictorContext)ctx;
   } catch (const std::invalid_argument &ex) {
     LOG(ERROR) << "exception: " << ex.what();
     errno = EINVAL;
+    report_error(error, ex);
     return nullptr;
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
                << "\n";
+    report_error(error, ex);
     return nullptr;
   }
 }
 
 PredictorContext NewCaffe2FromOnnx(char *model_data, int64_t model_data_len,
-                                   DeviceKind device_kind) {
+                                   DeviceKind device_kind,
+                                   const PredictorOptions *options,
+                                   char **error) {
   try {
     caffe2::onnx::Caffe2Backend onnx_instance;
     std::vector<caffe2::onnx::Caffe2Ops> extras;
@@ -339,16 +1367,70 @@ PredictorContext NewCaffe2FromOnnx(char *model_data, int64_t model_data_len,
 		set_operator_engine(&pred_net,   caffe2::CPU);
 		set_operator_engine(&init_net,   caffe2::CPU);
 	}
-    auto ctx = new mlmodelscope::Predictor(&init_net, &pred_net, device_kind);
+    auto ctx = new mlmodelscope::Predictor(
+        &init_net, &pred_net, device_kind,
+        options == nullptr ? DefaultPredictorOptionsCaffe2() : *options);
 	ctx->onnx_backend_ = onnx_backend;
     return (PredictorContext)ctx;
   } catch (const std::invalid_argument &ex) {
     LOG(ERROR) << "exception: " << ex.what();
     errno = EINVAL;
+    report_error(error, ex);
+    return nullptr;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    report_error(error, ex);
+    return nullptr;
+  }
+}
+
+PredictorContext NewCaffe2FromSpill(const char *spill_file,
+                                    DeviceKind device_kind,
+                                    const PredictorOptions *options,
+                                    char **error) {
+  try {
+    std::ifstream file(spill_file, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("cannot read spill file");
+    }
+    char magic[sizeof(spill_magic)];
+    file.read(magic, sizeof(magic));
+    if (!file || memcmp(magic, spill_magic, sizeof(magic)) != 0) {
+      throw std::runtime_error("invalid spill file");
+    }
+    NetDef pred_net;
+    if (!pred_net.ParseFromString(read_spill_string(file))) {
+      throw std::runtime_error("invalid spill file net");
+    }
+    uint64_t num_params = 0;
+    file.read(reinterpret_cast<char *>(&num_params), sizeof(num_params));
+    mlmodelscope::serialized_blobs_t params{};
+    for (uint64_t ii = 0; file && ii < num_params; ii++) {
+      auto name = read_spill_string(file);
+      params.emplace_back(std::move(name), read_spill_string(file));
+    }
+    if (params.size() != num_params) {
+      throw std::runtime_error("truncated spill file");
+    }
+    // the spilled net is already rewritten, the rewrites are not reapplied
+    auto spill_options =
+        options == nullptr ? DefaultPredictorOptionsCaffe2() : *options;
+    spill_options.optimize_graph = 0;
+    spill_options.input_mean = nullptr;
+    spill_options.input_std = nullptr;
+    auto ctx = new mlmodelscope::Predictor(nullptr, &pred_net, device_kind,
+                                           spill_options, &params);
+    return (PredictorContext)ctx;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    errno = EINVAL;
+    report_error(error, ex);
     return nullptr;
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
                << "\n";
+    report_error(error, ex);
     return nullptr;
   }
 }
@@ -394,8 +1476,13 @@ error_t PredictCaffe2(PredictorContext pred, float *imageData,
       std ::cout << __func__ << "  " << __LINE__ << " ... got a null pointer\n";
       return error_invalid_memory;
     }
-    predictor->Predict(imageData, input_type, batch_size, channels, width,
-                       height);
+    mlmodelscope::run_request request;
+    request.input = imageData;
+    request.batch_size = batch_size;
+    request.channels = channels;
+    request.width = width;
+    request.height = height;
+    predictor->Predict(request);
     return success;
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
@@ -404,39 +1491,338 @@ error_t PredictCaffe2(PredictorContext pred, float *imageData,
   }
 }
 
-float *GetPredictionsCaffe2(PredictorContext pred) {
+error_t PredictPartialCaffe2(PredictorContext pred, float *imageData,
+                             const char *output_blob, const int batch_size,
+                             const int channels, const int width,
+                             const int height) {
   try {
     auto predictor = (mlmodelscope::Predictor *)pred;
-    if (predictor == nullptr) {
-      return nullptr;
-    }
-    if (predictor->result_ == nullptr) {
-      throw std::runtime_error("expected a non-nil result");
+    if (predictor == nullptr || output_blob == nullptr) {
+      return error_invalid_memory;
     }
-    return (float *)predictor->result_;
+    mlmodelscope::run_request request;
+    request.input = imageData;
+    request.batch_size = batch_size;
+    request.channels = channels;
+    request.width = width;
+    request.height = height;
+    request.output_blob = output_blob;
+    predictor->Predict(request);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
                << "\n";
-    return nullptr;
+    return error_exception;
   }
 }
 
-void DeleteCaffe2(PredictorContext pred) {
+error_t PredictWithDeadlineCaffe2(PredictorContext pred, float *imageData,
+                                  const char *input_type, const int batch_size,
+                                  const int channels, const int width,
+                                  const int height, const int64_t timeout_us,
+                                  CancelTokenContext token) {
   try {
     auto predictor = (mlmodelscope::Predictor *)pred;
     if (predictor == nullptr) {
-      return;
-    }
-    if (predictor->ws_ != nullptr) {
-      delete predictor->ws_;
-    }
-    if (predictor->result_) {
-      free(predictor->result_);
+      return error_invalid_memory;
     }
-    if (predictor->prof_) {
-      predictor->prof_->reset();
-      delete predictor->prof_;
-      predictor->prof_ = nullptr;
+    mlmodelscope::run_request request;
+    request.input = imageData;
+    request.batch_size = batch_size;
+    request.channels = channels;
+    request.width = width;
+    request.height = height;
+    request.timeout_us = timeout_us;
+    request.token = (mlmodelscope::cancel_token *)token;
+    predictor->Predict(request);
+    return success;
+  } catch (const mlmodelscope::run_aborted &ex) {
+    return ex.code();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+error_t PredictFusedCaffe2(PredictorContext pred, float *input, float *output,
+                           const PredictRequest *request,
+                           PredictResponse *response) {
+  if (response == nullptr) {
+    return error_invalid_memory;
+  }
+  memset(response, 0, sizeof(*response));
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || request == nullptr || input == nullptr) {
+      return response->status = error_invalid_memory;
+    }
+    if (request->batch_size <= 0 || request->channels <= 0 ||
+        request->width <= 0 || request->height <= 0 ||
+        request->output_capacity < 0) {
+      return response->status = error_invalid_argument;
+    }
+    mlmodelscope::run_request run;
+    run.input = input;
+    run.batch_size = request->batch_size;
+    run.channels = request->channels;
+    run.width = request->width;
+    run.height = request->height;
+    run.timeout_us = request->timeout_us;
+    run.token = (mlmodelscope::cancel_token *)request->token;
+    run.profile = request->profile != 0;
+    std::shared_ptr<profile> prof{nullptr};
+    run.recorded = &prof;
+    run.output = output;
+    run.output_nbytes = request->output_capacity * sizeof(float);
+    if (request->output_blob != nullptr) {
+      run.output_blob = request->output_blob;
+    }
+    const auto written = predictor->Predict(run);
+    response->output = written != output ? written : nullptr;
+    response->pred_len = predictor->pred_len_;
+    response->output_size =
+        static_cast<int64_t>(predictor->pred_len_) * request->batch_size;
+    // the net observer ended the profile when the run was over, before
+    // the output was copied
+    if (run.profile && prof != nullptr) {
+      const auto s = prof->read();
+      response->profile = strdup(s.c_str());
+      if (!predictor->profile_enabled_) {
+        prof->reset();
+      }
+    }
+    return response->status = success;
+  } catch (const mlmodelscope::run_aborted &ex) {
+    return response->status = ex.code();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return response->status = error_exception;
+  }
+}
+
+int64_t NewSessionCaffe2(PredictorContext pred, const char **state_inputs,
+                         const char **state_outputs, const int num_states,
+                         const int64_t ttl_ms) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr ||
+        (num_states > 0 &&
+         (state_inputs == nullptr || state_outputs == nullptr))) {
+      return -1;
+    }
+    std::vector<std::pair<string, string>> states{};
+    for (int ii = 0; ii < num_states; ii++) {
+      states.emplace_back(state_inputs[ii], state_outputs[ii]);
+    }
+    return predictor->NewSession(states, ttl_ms);
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    errno = EINVAL;
+    return -1;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return -1;
+  }
+}
+
+error_t PredictSessionCaffe2(PredictorContext pred, const int64_t session,
+                             float *imageData, const int batch_size,
+                             const int channels, const int width,
+                             const int height) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || imageData == nullptr) {
+      return error_invalid_memory;
+    }
+    const auto s = predictor->GetSession(session);
+    std::lock_guard<std::mutex> lock(s->mut);
+    mlmodelscope::run_request request;
+    request.input = imageData;
+    request.batch_size = batch_size;
+    request.channels = channels;
+    request.width = width;
+    request.height = height;
+    request.session = s.get();
+    predictor->Predict(request);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (const mlmodelscope::run_aborted &ex) {
+    return ex.code();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+float *GetSessionPredictionsCaffe2(PredictorContext pred,
+                                   const int64_t session, int *pred_len) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || pred_len == nullptr) {
+      return nullptr;
+    }
+    const auto s = predictor->GetSession(session);
+    std::lock_guard<std::mutex> lock(s->mut);
+    if (s->output.empty()) {
+      throw std::runtime_error("the session has no output");
+    }
+    *pred_len = s->pred_len;
+    return s->output.data();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t DeleteSessionCaffe2(PredictorContext pred, const int64_t session) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return error_invalid_memory;
+    }
+    predictor->DeleteSession(session);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+char *ReadSessionsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto s = predictor->SessionsJson().dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+CancelTokenContext NewCancelTokenCaffe2() {
+  return (CancelTokenContext) new mlmodelscope::cancel_token();
+}
+
+void CancelCaffe2(CancelTokenContext token) {
+  auto cancel = (mlmodelscope::cancel_token *)token;
+  if (cancel != nullptr) {
+    cancel->cancelled = true;
+  }
+}
+
+void DeleteCancelTokenCaffe2(CancelTokenContext token) {
+  delete (mlmodelscope::cancel_token *)token;
+}
+
+error_t WarmupCaffe2(PredictorContext pred, const int iterations,
+                     const int *shapes, const int num_shapes,
+                     double *latencies) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || shapes == nullptr || latencies == nullptr) {
+      return error_invalid_memory;
+    }
+    if (iterations <= 0 || num_shapes <= 0) {
+      return error_invalid_argument;
+    }
+    std::vector<std::vector<int>> input_shapes{};
+    for (int ii = 0; ii < num_shapes; ii++) {
+      const auto shape = shapes + 4 * ii;
+      if (shape[0] <= 0 || shape[1] <= 0 || shape[2] <= 0 || shape[3] <= 0) {
+        return error_invalid_argument;
+      }
+      input_shapes.emplace_back(shape, shape + 4);
+    }
+    predictor->Warmup(predictor->State().get(), iterations, input_shapes,
+                      latencies);
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+error_t SwapWeightsCaffe2(PredictorContext pred, char *init_net_file,
+                          const int iterations, const int *shapes,
+                          const int num_shapes, double *latencies) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || init_net_file == nullptr) {
+      return error_invalid_memory;
+    }
+    if (iterations < 0 || num_shapes < 0 ||
+        (iterations > 0 && num_shapes > 0 && shapes == nullptr)) {
+      return error_invalid_argument;
+    }
+    std::vector<std::vector<int>> warmup_shapes{};
+    for (int ii = 0; ii < num_shapes; ii++) {
+      const auto shape = shapes + 4 * ii;
+      if (shape[0] <= 0 || shape[1] <= 0 || shape[2] <= 0 || shape[3] <= 0) {
+        return error_invalid_argument;
+      }
+      warmup_shapes.emplace_back(shape, shape + 4);
+    }
+    NetDef init_net;
+    if (!ReadProtoFromFile(init_net_file, &init_net)) {
+      throw std::runtime_error("cannot read init net file");
+    }
+    set_operator_engine(&init_net, predictor->device_kind_);
+    predictor->SwapWeights(&init_net, iterations, warmup_shapes, latencies);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+float *GetPredictionsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return nullptr;
+    }
+    if (predictor->result_ == nullptr) {
+      throw std::runtime_error("expected a non-nil result");
+    }
+    return (float *)predictor->result_;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+void DeleteCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    if (predictor->result_) {
+      free(predictor->result_);
     }
     delete predictor;
 
@@ -461,8 +1847,8 @@ void StartProfilingCaffe2(PredictorContext pred, const char *name,
     }
     auto predictor = (mlmodelscope::Predictor *)pred;
     predictor->profile_enabled_ = true;
-    predictor->profile_name_ = std::string(name);
-    predictor->profile_metadata_ = std::string(metadata);
+    predictor->profiling_.name = std::string(name);
+    predictor->profiling_.metadata = std::string(metadata);
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
                << "\n";
@@ -476,8 +1862,9 @@ void EndProfilingCaffe2(PredictorContext pred) {
     if (predictor == nullptr) {
       return;
     }
-    if (predictor->prof_) {
-      predictor->prof_->end();
+    const auto prof = predictor->profiling_.current();
+    if (prof != nullptr) {
+      prof->end();
     }
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
@@ -492,10 +1879,11 @@ void DisableProfilingCaffe2(PredictorContext pred) {
     if (predictor == nullptr) {
       return;
     }
-    if (predictor->prof_) {
-      predictor->prof_->reset();
-      predictor->profile_name_ = std::string("");
-      predictor->profile_metadata_ = std::string("");
+    const auto prof = predictor->profiling_.current();
+    if (prof != nullptr) {
+      prof->reset();
+      predictor->profiling_.name = std::string("");
+      predictor->profiling_.metadata = std::string("");
     }
   } catch (std::exception &ex) {
     LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
@@ -510,10 +1898,16 @@ char *ReadProfileCaffe2(PredictorContext pred) {
     if (predictor == nullptr) {
       return strdup("");
     }
-    if (predictor->prof_ == nullptr) {
+    const auto prof = predictor->profiling_.current();
+    if (prof == nullptr) {
       return strdup("");
     }
-    const auto s = predictor->prof_->read();
+    auto profile = prof->to_json();
+    const auto peak = mlmodelscope::machine_roofline::global().peak();
+    if (peak.threads != 0) {
+      profile["machine"] = peak.to_json();
+    }
+    const auto s = profile.dump();
     const auto cstr = s.c_str();
     return strdup(cstr);
   } catch (std::exception &ex) {
@@ -523,6 +1917,416 @@ char *ReadProfileCaffe2(PredictorContext pred) {
   }
 }
 
+int64_t ReadProfileBinaryCaffe2(PredictorContext pred, char *buffer,
+                                int64_t capacity) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || capacity < 0) {
+      return -1;
+    }
+    const auto prof = predictor->profiling_.current();
+    if (prof == nullptr) {
+      return 0;
+    }
+    return static_cast<int64_t>(prof->write_binary(buffer, capacity));
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return -1;
+  }
+}
+
+char *ReadProfileTraceCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto prof = predictor->profiling_.current();
+    if (prof == nullptr) {
+      return strdup("");
+    }
+    const auto s = prof->read_chrome_trace();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t StartSampledProfilingCaffe2(PredictorContext pred, int64_t every,
+                                    int64_t threshold_us, int keep) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return error_invalid_memory;
+    }
+    if (every < 0 || threshold_us < 0 || keep <= 0 ||
+        (every == 0 && threshold_us == 0)) {
+      return error_invalid_argument;
+    }
+    predictor->profiling_.sampler.configure(every, threshold_us, keep);
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+void EndSampledProfilingCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    predictor->profiling_.sampler.disable();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+  }
+}
+
+void ClearSampledProfilesCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    predictor->profiling_.sampler.clear();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+  }
+}
+
+char *ReadSampledProfilesCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto s = predictor->profiling_.sampler.read();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+void StartHistogramsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    predictor->profiling_.aggregating = true;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+  }
+}
+
+void EndHistogramsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    predictor->profiling_.aggregating = false;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+  }
+}
+
+void ResetHistogramsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return;
+    }
+    predictor->profiling_.histograms.reset();
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+  }
+}
+
+char *ReadHistogramsCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    auto report = predictor->profiling_.histograms.to_json();
+    report["enabled"] = predictor->profiling_.aggregating.load();
+    const auto s = report.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *MeasureMachinePeakCaffe2(int num_threads) {
+  try {
+    if (num_threads <= 0) {
+      num_threads = std::thread::hardware_concurrency();
+    }
+    const auto peak =
+        mlmodelscope::machine_roofline::global().measure(num_threads);
+    const auto s = peak.to_json().dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t EnablePerfCountersCaffe2(PredictorContext pred, int enable) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return error_invalid_memory;
+    }
+    if (enable != 0 && !mlmodelscope::perf_group::probe()) {
+      LOG(ERROR) << "hardware counters are not available: "
+                 << mlmodelscope::perf_status::global().to_json().dump();
+      return error_not_implemented;
+    }
+    predictor->profiling_.counting = enable != 0;
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+char *ReadPerfCountersStatusCaffe2() {
+  try {
+    auto status = mlmodelscope::perf_status::global().to_json();
+    status["available"] = mlmodelscope::perf_group::probe();
+    const auto s = status.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t SetClockCaffe2(ClockKind kind) {
+  try {
+    if (kind != STEADY_CLOCK && kind != TSC_CLOCK) {
+      return error_invalid_argument;
+    }
+    if (!profile_clock::global().select(kind)) {
+      return error_not_implemented;
+    }
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+char *ReadClockCaffe2() {
+  try {
+    const auto s = profile_clock::global().to_json().dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *ReadOptimizationReportCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto s = predictor->State()->report.read();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *ReadThreadingCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    auto config = predictor->threading_.to_json();
+    // GetThreadPool would create the default pool, outside of the affinity
+    // of the predictor. Load sized the pool when a thread count is set.
+    config["caffe2_pool_threads"] = predictor->threading_.num_threads();
+    const auto s = config.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *ReadNumaCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto node = predictor->numa_node_;
+    json report{{"node", node}};
+    if (node >= 0 && predictor->device_kind_ == CPU_DEVICE_KIND) {
+      const auto state = predictor->State();
+      report["parameters"] =
+          mlmodelscope::numa_query(predictor->TensorRanges(*state, true), node)
+              .to_json();
+      report["activations"] =
+          mlmodelscope::numa_query(predictor->TensorRanges(*state, false), node)
+              .to_json();
+    }
+    const auto s = report.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *ReadArenaCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto state = predictor->State();
+    if (state->arena == nullptr) {
+      return strdup("");
+    }
+    const auto s = state->arena->to_json().dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t StartExecutorCaffe2(const int num_workers) {
+  try {
+    mlmodelscope::run_executor::global().start(num_workers);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+char *ReadExecutorCaffe2(PredictorContext pred) {
+  try {
+    auto report = mlmodelscope::run_executor::global().to_json();
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor != nullptr) {
+      report["model"] = predictor->queue_->to_json();
+    }
+    const auto s = report.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *MeasureObserverOverheadCaffe2(PredictorContext pred,
+                                    const int iterations, const int batch,
+                                    const int channels, const int width,
+                                    const int height) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    if (iterations <= 0 || batch <= 0 || channels <= 0 || width <= 0 ||
+        height <= 0) {
+      throw std::invalid_argument("invalid iterations or input shape");
+    }
+    const auto report = predictor->MeasureObserverOverhead(
+        iterations, {batch, channels, width, height});
+    const auto s = report.dump();
+    return strdup(s.c_str());
+  } catch (std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    errno = EINVAL;
+    return nullptr;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+char *ReadPreemptionCaffe2(PredictorContext pred) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr) {
+      return strdup("");
+    }
+    const auto &control = predictor->State()->control;
+    const json report{
+        {"priority", predictor->priority_},
+        {"preemptions", control.preemptions()},
+        {"preempted_ms", control.preempted_ns() / 1.0e6},
+        {"active_high_priority_runs",
+         mlmodelscope::preemption_gate::global().active()},
+    };
+    const auto s = report.dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t GetMemoryUsageCaffe2(PredictorContext pred, MemoryUsage *usage) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || usage == nullptr) {
+      return error_invalid_memory;
+    }
+    usage->parameter_bytes = predictor->TensorBytes(true);
+    usage->activation_bytes = predictor->TensorBytes(false);
+    usage->peak_bytes = predictor->allocations_->peak_bytes();
+    usage->allocated_bytes = predictor->allocations_->live_bytes();
+    usage->output_bytes = predictor->result_nbytes_;
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
 int GetPredLenCaffe2(PredictorContext pred) {
   try {
     auto predictor = (mlmodelscope::Predictor *)pred;
@@ -536,3 +2340,116 @@ int GetPredLenCaffe2(PredictorContext pred) {
     return 0;
   }
 }
+
+error_t SpillCaffe2(PredictorContext pred, const char *spill_file) {
+  try {
+    auto predictor = (mlmodelscope::Predictor *)pred;
+    if (predictor == nullptr || spill_file == nullptr) {
+      return error_invalid_memory;
+    }
+    predictor->Spill(spill_file);
+    return success;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+ModelRegistryContext NewModelRegistryCaffe2(int64_t memory_budget,
+                                            const char *spill_dir) {
+  try {
+    return (ModelRegistryContext) new mlmodelscope::model_registry(
+        memory_budget, spill_dir == nullptr ? "" : spill_dir);
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t RegisterModelCaffe2(ModelRegistryContext registry, const char *id,
+                            const char *init_net_file, const char *net_file,
+                            DeviceKind device,
+                            const PredictorOptions *options) {
+  try {
+    auto models = (mlmodelscope::model_registry *)registry;
+    if (models == nullptr || id == nullptr || init_net_file == nullptr ||
+        net_file == nullptr) {
+      return error_invalid_memory;
+    }
+    models->add(id, init_net_file, net_file, device,
+                options == nullptr ? DefaultPredictorOptionsCaffe2()
+                                   : *options);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+PredictorContext AcquireModelCaffe2(ModelRegistryContext registry,
+                                    const char *id) {
+  try {
+    auto models = (mlmodelscope::model_registry *)registry;
+    if (models == nullptr || id == nullptr) {
+      return nullptr;
+    }
+    return models->acquire(id);
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    errno = EINVAL;
+    return nullptr;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+error_t ReleaseModelCaffe2(ModelRegistryContext registry, const char *id) {
+  try {
+    auto models = (mlmodelscope::model_registry *)registry;
+    if (models == nullptr || id == nullptr) {
+      return error_invalid_memory;
+    }
+    models->release(id);
+    return success;
+  } catch (const std::invalid_argument &ex) {
+    LOG(ERROR) << "exception: " << ex.what();
+    return error_invalid_argument;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return error_exception;
+  }
+}
+
+char *ReadModelRegistryCaffe2(ModelRegistryContext registry) {
+  try {
+    auto models = (mlmodelscope::model_registry *)registry;
+    if (models == nullptr) {
+      return strdup("");
+    }
+    const auto s = models->to_json().dump();
+    return strdup(s.c_str());
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return nullptr;
+  }
+}
+
+void DeleteModelRegistryCaffe2(ModelRegistryContext registry) {
+  try {
+    delete (mlmodelscope::model_registry *)registry;
+  } catch (std::exception &ex) {
+    LOG(ERROR) << "exception: catch all [ " << ex.what() << "]"
+               << "\n";
+    return;
+  }
+}
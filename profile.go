@@ -0,0 +1,421 @@
+package caffe2
+
+// #include <stdlib.h>
+// #include "cbits/predictor.hpp"
+import "C"
+import (
+	"encoding/binary"
+	"encoding/json"
+	"sort"
+	"time"
+	"unsafe"
+
+	"github.com/pkg/errors"
+)
+
+// ProfileElement is an operator run of a profile.
+type ProfileElement struct {
+	Name               string  `json:"name"`
+	Metadata           string  `json:"metadata"`
+	Start              uint64  `json:"start"`
+	End                uint64  `json:"end"`
+	LayerSequenceIndex int     `json:"layer_sequence_index"`
+	Shapes             [][]int `json:"shapes"`
+	ThreadID           uint64  `json:"thread_id"`
+	// Flops and Bytes are the estimated work of the operator, zero when
+	// the operator is not known to the estimator.
+	Flops               float64 `json:"flops"`
+	Bytes               float64 `json:"bytes"`
+	GFlops              float64 `json:"gflops"`
+	GBps                float64 `json:"gbps"`
+	ArithmeticIntensity float64 `json:"arithmetic_intensity"`
+	// Counters are the hardware counters of the run, nil when they were not
+	// read.
+	Counters *PerfCounters `json:"counters,omitempty"`
+}
+
+// PerfCounters are the user space hardware counters of an operator run.
+type PerfCounters struct {
+	Cycles       uint64  `json:"cycles"`
+	Instructions uint64  `json:"instructions"`
+	LLCMisses    uint64  `json:"llc_misses"`
+	BranchMisses uint64  `json:"branch_misses"`
+	IPC          float64 `json:"ipc"`
+}
+
+// PerfCountersStatus tells whether the hardware counters can be read.
+type PerfCountersStatus struct {
+	Available    bool   `json:"available"`
+	Error        string `json:"error"`
+	OpenFailures int64  `json:"open_failures"`
+}
+
+// EnablePerfCounters makes the profiled operator runs read the hardware
+// counters of their thread. It fails when the kernel does not allow them,
+// e.g. because of perf_event_paranoid or in a virtual machine.
+func (p *Predictor) EnablePerfCounters(enable bool) error {
+	cEnable := C.int(0)
+	if enable {
+		cEnable = 1
+	}
+	switch C.EnablePerfCountersCaffe2(p.ctx, cEnable) {
+	case C.success:
+		return nil
+	case C.error_not_implemented:
+		status, err := ReadPerfCountersStatus()
+		if err != nil {
+			return errors.New("hardware counters are not available")
+		}
+		return errors.Errorf("hardware counters are not available: %s", status.Error)
+	default:
+		return errors.New("failed to enable hardware counters")
+	}
+}
+
+// ReadPerfCountersStatus returns whether the hardware counters can be read.
+func ReadPerfCountersStatus() (*PerfCountersStatus, error) {
+	cstr := C.ReadPerfCountersStatusCaffe2()
+	if cstr == nil {
+		return nil, errors.New("failed to read nil hardware counters status")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	status := &PerfCountersStatus{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), status); err != nil {
+		return nil, errors.Wrap(err, "failed to decode hardware counters status")
+	}
+	return status, nil
+}
+
+// MachinePeak is the roofline of the machine.
+type MachinePeak struct {
+	Threads           int     `json:"threads"`
+	PeakGFlops        float64 `json:"peak_gflops"`
+	PeakGBps          float64 `json:"peak_gbps"`
+	RidgeFlopsPerByte float64 `json:"ridge_flops_per_byte"`
+}
+
+// MeasureMachinePeak measures the floating point throughput and the memory
+// bandwidth of the machine on numThreads threads, all the cores when it is
+// zero. It takes around a second. The profiles read afterwards include the
+// measure.
+func MeasureMachinePeak(numThreads int) (*MachinePeak, error) {
+	cstr := C.MeasureMachinePeakCaffe2(C.int(numThreads))
+	if cstr == nil {
+		return nil, errors.New("failed to read nil machine peak")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	peak := &MachinePeak{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), peak); err != nil {
+		return nil, errors.Wrap(err, "failed to decode machine peak")
+	}
+	return peak, nil
+}
+
+// Profile is a profiled run of a net. The times are in nanoseconds since
+// the epoch. It is decoded from either the JSON of ReadProfile or the
+// binary encoding of ReadProfileBinary.
+type Profile struct {
+	Name     string           `json:"name"`
+	Metadata string           `json:"metadata"`
+	Start    uint64           `json:"start"`
+	End      uint64           `json:"end"`
+	Dropped  uint64           `json:"dropped"`
+	ThreadID uint64           `json:"thread_id"`
+	Elements []ProfileElement `json:"elements"`
+	Memory   ProfileMemory    `json:"memory"`
+	Machine  *MachinePeak     `json:"machine,omitempty"`
+}
+
+// MemoryEvent is an allocation (positive Bytes) or a free (negative Bytes)
+// made during a profiled run. LayerSequenceIndex is the operator that the
+// allocating thread was running, -1 outside of the operators.
+type MemoryEvent struct {
+	Time               uint64 `json:"time"`
+	Bytes              int64  `json:"bytes"`
+	LiveBytes          int64  `json:"live_bytes"`
+	LayerSequenceIndex int    `json:"layer_sequence_index"`
+}
+
+// LayerMemory sums the memory events attributed to an operator.
+type LayerMemory struct {
+	LayerSequenceIndex int   `json:"layer_sequence_index"`
+	Allocations        int64 `json:"allocations"`
+	AllocatedBytes     int64 `json:"allocated_bytes"`
+	Frees              int64 `json:"frees"`
+	FreedBytes         int64 `json:"freed_bytes"`
+	PeakLiveBytes      int64 `json:"peak_live_bytes"`
+}
+
+// ProfileMemory is the memory timeline of a profiled run.
+type ProfileMemory struct {
+	Timeline               []MemoryEvent `json:"timeline"`
+	Layers                 []LayerMemory `json:"layers"`
+	PeakLiveBytes          int64         `json:"peak_live_bytes"`
+	PeakLayerSequenceIndex int           `json:"peak_layer_sequence_index"`
+	Dropped                uint64        `json:"dropped"`
+}
+
+const profileBinaryVersion = 4
+
+// ReadProfileBinary encodes the profile in the compact binary format into
+// buf, growing it when it is too small, and returns the encoding. It
+// returns an empty slice when there is no profile. Reusing the returned
+// slice across calls avoids allocating per request.
+func (p *Predictor) ReadProfileBinary(buf []byte) ([]byte, error) {
+	for {
+		var ptr *C.char
+		if cap(buf) != 0 {
+			buf = buf[:cap(buf)]
+			ptr = (*C.char)(unsafe.Pointer(&buf[0]))
+		}
+		n := int(C.ReadProfileBinaryCaffe2(p.ctx, ptr, C.int64_t(len(buf))))
+		if n < 0 {
+			return nil, errors.New("failed to read binary profile")
+		}
+		if n <= len(buf) {
+			return buf[:n], nil
+		}
+		buf = make([]byte, n)
+	}
+}
+
+// profileDecoder reads the varints of a binary profile.
+type profileDecoder struct {
+	data []byte
+	err  error
+}
+
+func (d *profileDecoder) uvarint() uint64 {
+	if d.err != nil {
+		return 0
+	}
+	v, n := binary.Uvarint(d.data)
+	if n <= 0 {
+		d.err = errors.New("truncated binary profile")
+		return 0
+	}
+	d.data = d.data[n:]
+	return v
+}
+
+func (d *profileDecoder) varint() int64 {
+	v := d.uvarint()
+	return int64(v>>1) ^ -int64(v&1)
+}
+
+// count reads a table size, which cannot exceed the bytes left since every
+// entry takes at least one byte.
+func (d *profileDecoder) count() int {
+	n := d.uvarint()
+	if d.err == nil && n > uint64(len(d.data)) {
+		d.err = errors.New("corrupted binary profile")
+		return 0
+	}
+	return int(n)
+}
+
+func (d *profileDecoder) string() string {
+	n := d.count()
+	if d.err != nil {
+		return ""
+	}
+	s := string(d.data[:n])
+	d.data = d.data[n:]
+	return s
+}
+
+func (d *profileDecoder) index(size int) int {
+	ii := d.uvarint()
+	if d.err == nil && ii >= uint64(size) {
+		d.err = errors.New("corrupted binary profile")
+		return 0
+	}
+	return int(ii)
+}
+
+// DecodeProfile decodes a profile returned by ReadProfileBinary.
+func DecodeProfile(data []byte) (*Profile, error) {
+	if len(data) < 4 || string(data[:4]) != "C2PF" {
+		return nil, errors.New("not a binary profile")
+	}
+	d := &profileDecoder{data: data[4:]}
+	if version := d.uvarint(); d.err == nil && version != profileBinaryVersion {
+		return nil, errors.Errorf("unsupported binary profile version %d", version)
+	}
+
+	prof := &Profile{}
+	prof.Name = d.string()
+	prof.Metadata = d.string()
+	prof.Start = d.uvarint()
+	prof.End = uint64(int64(prof.Start) + d.varint())
+	prof.Dropped = d.uvarint()
+	netThread := d.uvarint()
+
+	strings := make([]string, d.count())
+	for ii := range strings {
+		strings[ii] = d.string()
+	}
+	shapes := make([][][]int, d.count())
+	for ii := range shapes {
+		shapes[ii] = make([][]int, d.count())
+		for jj := range shapes[ii] {
+			shapes[ii][jj] = make([]int, d.count())
+			for kk := range shapes[ii][jj] {
+				shapes[ii][jj][kk] = int(d.varint())
+			}
+		}
+	}
+	threads := make([]uint64, d.count())
+	for ii := range threads {
+		threads[ii] = d.uvarint()
+	}
+	if d.err == nil && netThread < uint64(len(threads)) {
+		prof.ThreadID = threads[netThread]
+	}
+
+	prof.Elements = make([]ProfileElement, d.count())
+	previous := int64(prof.Start)
+	for ii := range prof.Elements {
+		e := &prof.Elements[ii]
+		start := previous + d.varint()
+		e.Start = uint64(start)
+		e.End = uint64(start + d.varint())
+		e.LayerSequenceIndex = int(d.varint())
+		name, metadata := d.index(len(strings)), d.index(len(strings))
+		shape, thread := d.index(len(shapes)), d.index(len(threads))
+		if d.err != nil {
+			break
+		}
+		e.Name, e.Metadata = strings[name], strings[metadata]
+		e.Shapes, e.ThreadID = shapes[shape], threads[thread]
+		e.Flops, e.Bytes = float64(d.uvarint()), float64(d.uvarint())
+		if ns := float64(e.End - e.Start); ns > 0 {
+			e.GFlops, e.GBps = e.Flops/ns, e.Bytes/ns
+		}
+		if e.Bytes > 0 {
+			e.ArithmeticIntensity = e.Flops / e.Bytes
+		}
+		if d.uvarint() != 0 {
+			c := &PerfCounters{
+				Cycles:       d.uvarint(),
+				Instructions: d.uvarint(),
+				LLCMisses:    d.uvarint(),
+				BranchMisses: d.uvarint(),
+			}
+			if c.Cycles != 0 {
+				c.IPC = float64(c.Instructions) / float64(c.Cycles)
+			}
+			e.Counters = c
+		}
+		previous = start
+	}
+	if d.err != nil {
+		return nil, d.err
+	}
+
+	prof.Memory.Dropped = d.uvarint()
+	prof.Memory.Timeline = make([]MemoryEvent, d.count())
+	prof.Memory.PeakLayerSequenceIndex = -1
+	layers := map[int]*LayerMemory{}
+	previous = int64(prof.Start)
+	for ii := range prof.Memory.Timeline {
+		e := &prof.Memory.Timeline[ii]
+		time := previous + d.varint()
+		e.Time = uint64(time)
+		e.Bytes = d.varint()
+		e.LiveBytes = d.varint()
+		e.LayerSequenceIndex = int(d.varint())
+		previous = time
+
+		layer, ok := layers[e.LayerSequenceIndex]
+		if !ok {
+			layer = &LayerMemory{LayerSequenceIndex: e.LayerSequenceIndex}
+			layers[e.LayerSequenceIndex] = layer
+		}
+		if e.Bytes >= 0 {
+			layer.Allocations++
+			layer.AllocatedBytes += e.Bytes
+		} else {
+			layer.Frees++
+			layer.FreedBytes -= e.Bytes
+		}
+		if e.LiveBytes > layer.PeakLiveBytes {
+			layer.PeakLiveBytes = e.LiveBytes
+		}
+		if e.LiveBytes > prof.Memory.PeakLiveBytes {
+			prof.Memory.PeakLiveBytes = e.LiveBytes
+			prof.Memory.PeakLayerSequenceIndex = e.LayerSequenceIndex
+		}
+	}
+	if d.err != nil {
+		return nil, d.err
+	}
+	for _, layer := range layers {
+		prof.Memory.Layers = append(prof.Memory.Layers, *layer)
+	}
+	sort.Slice(prof.Memory.Layers, func(ii, jj int) bool {
+		return prof.Memory.Layers[ii].LayerSequenceIndex < prof.Memory.Layers[jj].LayerSequenceIndex
+	})
+	return prof, nil
+}
+
+// SampledProfile is the profile of a prediction kept by sampled profiling.
+// Reason is "rate" when it was one of every N predictions, "latency" when
+// it exceeded the threshold and "aborted" when it was stopped by its
+// deadline or cancelled, in which case the profile ends where it stopped.
+type SampledProfile struct {
+	Profile
+	LatencyMs float64 `json:"latency_ms"`
+	Reason    string  `json:"reason"`
+}
+
+// SampledProfiles are the last profiles kept by sampled profiling.
+type SampledProfiles struct {
+	Enabled     bool             `json:"enabled"`
+	Every       int64            `json:"every"`
+	ThresholdUs int64            `json:"threshold_us"`
+	Keep        int              `json:"keep"`
+	Runs        int64            `json:"runs"`
+	Sampled     int64            `json:"sampled"`
+	Profiles    []SampledProfile `json:"profiles"`
+}
+
+// StartSampledProfiling profiles one in every `every` predictions (none when
+// 0) and the predictions slower than threshold (none when 0), and keeps the
+// last `keep` of their profiles. It is meant to be left on for production
+// traffic: when only every is set the other predictions are not recorded.
+func (p *Predictor) StartSampledProfiling(every int, threshold time.Duration, keep int) error {
+	switch C.StartSampledProfilingCaffe2(p.ctx, C.int64_t(every), C.int64_t(threshold/time.Microsecond), C.int(keep)) {
+	case C.success:
+		return nil
+	case C.error_invalid_argument:
+		return errors.Errorf("invalid sampled profiling every=%d threshold=%v keep=%d", every, threshold, keep)
+	default:
+		return errors.New("failed to start sampled profiling")
+	}
+}
+
+// EndSampledProfiling stops sampling, the kept profiles can still be read.
+func (p *Predictor) EndSampledProfiling() {
+	C.EndSampledProfilingCaffe2(p.ctx)
+}
+
+// ClearSampledProfiles drops the kept profiles.
+func (p *Predictor) ClearSampledProfiles() {
+	C.ClearSampledProfilesCaffe2(p.ctx)
+}
+
+// ReadSampledProfiles returns the profiles kept by sampled profiling, the
+// oldest first.
+func (p *Predictor) ReadSampledProfiles() (*SampledProfiles, error) {
+	cstr := C.ReadSampledProfilesCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil sampled profiles")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	profiles := &SampledProfiles{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), profiles); err != nil {
+		return nil, errors.Wrap(err, "failed to decode sampled profiles")
+	}
+	return profiles, nil
+}
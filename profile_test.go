@@ -0,0 +1,184 @@
+package caffe2
+
+import (
+	"encoding/json"
+	"reflect"
+	"testing"
+)
+
+// binaryProfile is the encoding of a profile of two operator runs, the
+// first with hardware counters, and of an allocation then its free
+var binaryProfile = []byte{
+	'C', '2', 'P', 'F', 4,
+	3, 'n', 'e', 't', // name
+	1, 'm', // metadata
+	0xe8, 0x07, // start_ns 1000
+	0xe8, 0x07, // duration_ns 500
+	2, // dropped
+	0, // thread
+	// strings
+	2,
+	4, 'C', 'o', 'n', 'v',
+	5, 'c', 'o', 'n', 'v', '1',
+	// shapes: one list of one shape [1 3]
+	1, 1, 2, 2, 6,
+	// threads
+	2, 7, 9,
+	// records
+	2,
+	20, 0xc8, 0x01, 2, 0, 1, 0, 1, 0xc8, 0x01, 100, 1, 50, 100, 3, 4,
+	0xac, 0x02, 100, 4, 0, 1, 0, 0, 0, 0, 0,
+	// memory
+	1, 2,
+	40, 0x80, 0x01, 0x80, 0x01, 2,
+	60, 0x7f, 0, 1,
+}
+
+func TestDecodeProfile(t *testing.T) {
+	prof, err := DecodeProfile(binaryProfile)
+	if err != nil {
+		t.Fatal(err)
+	}
+	shapes := [][]int{{1, 3}}
+	expected := &Profile{
+		Name:     "net",
+		Metadata: "m",
+		Start:    1000,
+		End:      1500,
+		Dropped:  2,
+		ThreadID: 7,
+		Elements: []ProfileElement{
+			{
+				Name:                "Conv",
+				Metadata:            "conv1",
+				Start:               1010,
+				End:                 1110,
+				LayerSequenceIndex:  1,
+				Shapes:              shapes,
+				ThreadID:            9,
+				Flops:               200,
+				Bytes:               100,
+				GFlops:              2,
+				GBps:                1,
+				ArithmeticIntensity: 2,
+				Counters: &PerfCounters{
+					Cycles:       50,
+					Instructions: 100,
+					LLCMisses:    3,
+					BranchMisses: 4,
+					IPC:          2,
+				},
+			},
+			{
+				Name:               "Conv",
+				Metadata:           "conv1",
+				Start:              1160,
+				End:                1210,
+				LayerSequenceIndex: 2,
+				Shapes:             shapes,
+				ThreadID:           7,
+			},
+		},
+		Memory: ProfileMemory{
+			Timeline: []MemoryEvent{
+				{Time: 1020, Bytes: 64, LiveBytes: 64, LayerSequenceIndex: 1},
+				{Time: 1050, Bytes: -64, LiveBytes: 0, LayerSequenceIndex: -1},
+			},
+			Layers: []LayerMemory{
+				{LayerSequenceIndex: -1, Frees: 1, FreedBytes: 64},
+				{LayerSequenceIndex: 1, Allocations: 1, AllocatedBytes: 64, PeakLiveBytes: 64},
+			},
+			PeakLiveBytes:          64,
+			PeakLayerSequenceIndex: 1,
+			Dropped:                1,
+		},
+	}
+	if !reflect.DeepEqual(prof, expected) {
+		t.Errorf("decoded %+v, expected %+v", prof, expected)
+	}
+}
+
+func TestDecodeTruncatedProfile(t *testing.T) {
+	for n := 0; n < len(binaryProfile); n++ {
+		if _, err := DecodeProfile(binaryProfile[:n]); err == nil {
+			t.Errorf("decoded the first %d bytes of the profile", n)
+		}
+	}
+}
+
+func TestDecodeCorruptedProfile(t *testing.T) {
+	corrupt := func(offset int, b byte) []byte {
+		data := append([]byte(nil), binaryProfile...)
+		data[offset] = b
+		return data
+	}
+	for _, test := range []struct {
+		name string
+		data []byte
+	}{
+		{"magic", corrupt(0, 'X')},
+		{"version", corrupt(4, 3)},
+		// the name claims more bytes than are left
+		{"string length", corrupt(5, 0x7f)},
+		// the first record names a string past the table
+		{"string index", corrupt(42, 2)},
+		// the first record has a shape past the table
+		{"shape index", corrupt(44, 1)},
+		// the first record runs on a thread past the table
+		{"thread index", corrupt(45, 2)},
+	} {
+		if _, err := DecodeProfile(test.data); err == nil {
+			t.Errorf("decoded a profile with a corrupted %s", test.name)
+		}
+	}
+}
+
+func TestProfileBinaryRoundTrip(t *testing.T) {
+	pred := newTestPredictor(t, convBNInitNet, convBNReluPredictNet, PredictorOptions{DisableGraphOptimizations: true})
+	defer pred.Close()
+
+	if err := pred.StartProfiling("round_trip", "meta"); err != nil {
+		t.Fatal(err)
+	}
+	predictOnce(t, pred, convBNInput, 1, 2, 2)
+	if err := pred.EndProfiling(); err != nil {
+		t.Fatal(err)
+	}
+
+	s, err := pred.ReadProfile()
+	if err != nil {
+		t.Fatal(err)
+	}
+	expected := &Profile{}
+	if err := json.Unmarshal([]byte(s), expected); err != nil {
+		t.Fatal(err)
+	}
+	data, err := pred.ReadProfileBinary(nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	prof, err := DecodeProfile(data)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if prof.Name != expected.Name || prof.Metadata != expected.Metadata {
+		t.Errorf("decoded %q (%q), expected %q (%q)", prof.Name, prof.Metadata, expected.Name, expected.Metadata)
+	}
+	if len(expected.Elements) == 0 {
+		t.Fatal("the profile has no operator runs")
+	}
+	if len(prof.Elements) != len(expected.Elements) {
+		t.Fatalf("decoded %d operator runs, expected %d", len(prof.Elements), len(expected.Elements))
+	}
+	for ii, e := range expected.Elements {
+		got := prof.Elements[ii]
+		if got.Name != e.Name || got.Metadata != e.Metadata || got.LayerSequenceIndex != e.LayerSequenceIndex {
+			t.Errorf("operator run %d decoded as %s %s (layer %d), expected %s %s (layer %d)", ii,
+				got.Name, got.Metadata, got.LayerSequenceIndex, e.Name, e.Metadata, e.LayerSequenceIndex)
+		}
+		if !reflect.DeepEqual(got.Shapes, e.Shapes) {
+			t.Errorf("operator run %d decoded with shapes %v, expected %v", ii, got.Shapes, e.Shapes)
+		}
+	}
+}
@@ -0,0 +1,178 @@
+package caffe2
+
+// #include <stdlib.h>
+// #include "cbits/predictor.hpp"
+import "C"
+import (
+	"context"
+	"encoding/json"
+	"path/filepath"
+	"sync"
+	"unsafe"
+
+	"github.com/rai-project/dlframework/framework/options"
+	"github.com/rai-project/tracer"
+
+	"github.com/Unknwon/com"
+	"github.com/pkg/errors"
+)
+
+// Registry serves many models from one process. The predictor of a model is
+// created the first time it is acquired and stays loaded while the loaded
+// models fit in the memory budget, past which the least recently used idle
+// models are deleted. Evicted models are spilled to SpillDir, when set, so
+// that reloading them skips the init net and the graph optimizations.
+type Registry struct {
+	ctx     C.ModelRegistryContext
+	mu      sync.Mutex
+	options map[string]*options.Options
+}
+
+// RegistryStats are the counters of a Registry.
+type RegistryStats struct {
+	Models       int64 `json:"models"`
+	Loaded       int64 `json:"loaded"`
+	InUse        int64 `json:"in_use"`
+	MemoryBudget int64 `json:"memory_budget"`
+	UsedBytes    int64 `json:"used_bytes"`
+	Hits         int64 `json:"hits"`
+	Misses       int64 `json:"misses"`
+	Evictions    int64 `json:"evictions"`
+	Spills       int64 `json:"spills"`
+	SpillLoads   int64 `json:"spill_loads"`
+	LoadFailures int64 `json:"load_failures"`
+	OverBudget   int64 `json:"over_budget"`
+}
+
+// NewRegistry creates a registry that keeps the loaded models within
+// memoryBudget bytes, zero for no budget. spillDir may be empty to not
+// spill the evicted models.
+func NewRegistry(memoryBudget int64, spillDir string) (*Registry, error) {
+	if memoryBudget < 0 {
+		return nil, errors.New("the memory budget must be positive")
+	}
+	if spillDir != "" && !com.IsDir(spillDir) {
+		return nil, errors.Errorf("spill directory %s not found", spillDir)
+	}
+	cSpillDir := (*C.char)(nil)
+	if spillDir != "" {
+		cSpillDir = C.CString(spillDir)
+		defer C.free(unsafe.Pointer(cSpillDir))
+	}
+	ctx := C.NewModelRegistryCaffe2(C.int64_t(memoryBudget), cSpillDir)
+	if ctx == nil {
+		return nil, errors.New("unable to create caffe2 model registry")
+	}
+	return &Registry{
+		ctx:     ctx,
+		options: map[string]*options.Options{},
+	}, nil
+}
+
+// Register adds a model to the registry without loading it. Only models
+// made of an init net and a predict net are supported, and since they are
+// loaded on demand the warmup options are not.
+func (r *Registry) Register(id string, predOpts PredictorOptions, opts ...options.Option) error {
+	if len(predOpts.WarmupShapes) != 0 {
+		return errors.New("registered models cannot be warmed up on creation")
+	}
+	options := options.New(opts...)
+	initNetFile := string(options.Weights())
+	if filepath.Ext(initNetFile) == ".onnx" {
+		return errors.New("onnx models cannot be registered")
+	}
+	if !com.IsFile(initNetFile) {
+		return errors.Errorf("file %s not found", initNetFile)
+	}
+	predictNetFile := string(options.Graph())
+	if !com.IsFile(predictNetFile) {
+		return errors.Errorf("file %s not found", predictNetFile)
+	}
+
+	device, err := deviceKind(options)
+	if err != nil {
+		return err
+	}
+	C.InitCaffe2(device)
+
+	cOpts, freeOpts, err := predOpts.toC()
+	if err != nil {
+		return err
+	}
+	defer freeOpts()
+
+	cID := C.CString(id)
+	cInitNetFile := C.CString(initNetFile)
+	cPredictNetFile := C.CString(predictNetFile)
+	defer func() {
+		C.free(unsafe.Pointer(cID))
+		C.free(unsafe.Pointer(cInitNetFile))
+		C.free(unsafe.Pointer(cPredictNetFile))
+	}()
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	ok := C.RegisterModelCaffe2(r.ctx, cID, cInitNetFile, cPredictNetFile, device, &cOpts)
+	if ok != 0 {
+		return errors.Errorf("unable to register model %s", id)
+	}
+	r.options[id] = options
+	return nil
+}
+
+// Acquire returns the predictor of a registered model, loading it if
+// needed. The model is not evicted until the predictor is closed. A
+// predictor cannot run concurrent predictions, so Acquire blocks while
+// another caller holds the predictor of the model.
+func (r *Registry) Acquire(ctx context.Context, id string) (*Predictor, error) {
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_acquire")
+	defer span.Finish()
+
+	r.mu.Lock()
+	options, ok := r.options[id]
+	r.mu.Unlock()
+	if !ok {
+		return nil, errors.Errorf("model %s is not registered", id)
+	}
+
+	cID := C.CString(id)
+	defer C.free(unsafe.Pointer(cID))
+	pred := C.AcquireModelCaffe2(r.ctx, cID)
+	if pred == nil {
+		return nil, errors.Errorf("unable to load model %s", id)
+	}
+
+	return &Predictor{
+		ctx:      pred,
+		options:  options,
+		registry: r,
+		modelID:  id,
+	}, nil
+}
+
+func (r *Registry) release(id string) {
+	cID := C.CString(id)
+	defer C.free(unsafe.Pointer(cID))
+	C.ReleaseModelCaffe2(r.ctx, cID)
+}
+
+// Stats returns the registry counters.
+func (r *Registry) Stats() (*RegistryStats, error) {
+	cstr := C.ReadModelRegistryCaffe2(r.ctx)
+	if cstr == nil {
+		return nil, errors.New("unable to read the caffe2 model registry stats")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := new(RegistryStats)
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "unable to decode the caffe2 model registry stats")
+	}
+	return stats, nil
+}
+
+// Close deletes the registry and the predictors it holds. It waits for the
+// predictors acquired from it to be closed.
+func (r *Registry) Close() {
+	C.DeleteModelRegistryCaffe2(r.ctx)
+	r.ctx = nil
+}
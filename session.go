@@ -0,0 +1,128 @@
+package caffe2
+
+// #include <stdlib.h>
+// #include "cbits/predictor.hpp"
+import "C"
+import (
+	"context"
+	"encoding/json"
+	"fmt"
+	"time"
+	"unsafe"
+
+	"github.com/rai-project/tracer"
+
+	"github.com/pkg/errors"
+)
+
+// Session runs a recurrent model one step at a time while its state stays
+// in the predictor between steps.
+type Session struct {
+	predictor *Predictor
+	id        C.int64_t
+}
+
+// SessionStats are the session counters of a predictor.
+type SessionStats struct {
+	Active  int64 `json:"active"`
+	Created int64 `json:"created"`
+	Expired int64 `json:"expired"`
+}
+
+// NewSession creates a session. states maps the state input blobs of the
+// net to the output blobs that hold their value for the next step. The
+// session is deleted when it is not used for ttl, zero to keep it until it
+// is closed.
+func (p *Predictor) NewSession(states map[string]string, ttl time.Duration) (*Session, error) {
+	if ttl < 0 {
+		return nil, errors.New("the session ttl must be positive")
+	}
+
+	numStates := len(states)
+	var cInputs, cOutputs **C.char
+	if numStates != 0 {
+		ptrSize := C.size_t(unsafe.Sizeof(uintptr(0)))
+		cInputsData := C.malloc(C.size_t(numStates) * ptrSize)
+		cOutputsData := C.malloc(C.size_t(numStates) * ptrSize)
+		defer C.free(cInputsData)
+		defer C.free(cOutputsData)
+		inputs := (*[1 << 20]*C.char)(cInputsData)[:numStates:numStates]
+		outputs := (*[1 << 20]*C.char)(cOutputsData)[:numStates:numStates]
+		ii := 0
+		for input, output := range states {
+			inputs[ii] = C.CString(input)
+			outputs[ii] = C.CString(output)
+			defer C.free(unsafe.Pointer(inputs[ii]))
+			defer C.free(unsafe.Pointer(outputs[ii]))
+			ii++
+		}
+		cInputs = (**C.char)(cInputsData)
+		cOutputs = (**C.char)(cOutputsData)
+	}
+
+	id := C.NewSessionCaffe2(p.ctx, cInputs, cOutputs, C.int(numStates), C.int64_t(ttl/time.Millisecond))
+	if id < 0 {
+		return nil, errors.New("unable to create caffe2 session")
+	}
+	return &Session{predictor: p, id: id}, nil
+}
+
+// Predict runs the next step of the sequence. The output is read with the
+// ReadPredictionOutput method of the session. The sessions of a predictor
+// can run their steps concurrently.
+func (s *Session) Predict(ctx context.Context, data []float32, channels int,
+	width int, height int) error {
+	batchSize := s.predictor.options.BatchSize()
+	if len(data) < batchSize*channels*width*height {
+		return errors.New("input data is smaller than the batch")
+	}
+
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_predict_session")
+	defer span.Finish()
+
+	ok := C.PredictSessionCaffe2(s.predictor.ctx, s.id, (*C.float)(unsafe.Pointer(&data[0])),
+		C.int(batchSize), C.int(channels), C.int(width), C.int(height))
+	if ok != 0 {
+		return fmt.Errorf("unable to perform caffe2 prediction for session %d", int64(s.id))
+	}
+	return nil
+}
+
+// ReadPredictionOutput returns a copy of the output of the last step of the
+// session.
+func (s *Session) ReadPredictionOutput(ctx context.Context) ([]float32, error) {
+	span, _ := tracer.StartSpanFromContext(ctx, tracer.MODEL_TRACE, "c_read_session_output")
+	defer span.Finish()
+
+	var cPredLen C.int
+	cPredictions := C.GetSessionPredictionsCaffe2(s.predictor.ctx, s.id, &cPredLen)
+	if cPredictions == nil {
+		return nil, fmt.Errorf("unable to read the output of session %d", int64(s.id))
+	}
+	length := s.predictor.options.BatchSize() * int(cPredLen)
+	predictions := make([]float32, length)
+	copy(predictions, (*[1 << 30]float32)(unsafe.Pointer(cPredictions))[:length:length])
+	return predictions, nil
+}
+
+// Close deletes the session and its state.
+func (s *Session) Close() error {
+	if C.DeleteSessionCaffe2(s.predictor.ctx, s.id) != 0 {
+		return fmt.Errorf("session %d does not exist or expired", int64(s.id))
+	}
+	return nil
+}
+
+// ReadSessions returns the session counters of the predictor.
+func (p *Predictor) ReadSessions() (*SessionStats, error) {
+	cstr := C.ReadSessionsCaffe2(p.ctx)
+	if cstr == nil {
+		return nil, errors.New("failed to read nil session statistics")
+	}
+	defer C.free(unsafe.Pointer(cstr))
+	stats := &SessionStats{}
+	if err := json.Unmarshal([]byte(C.GoString(cstr)), stats); err != nil {
+		return nil, errors.Wrap(err, "failed to decode session statistics")
+	}
+	return stats, nil
+}
@@ -0,0 +1,77 @@
+package caffe2
+
+import (
+	"context"
+	"sync"
+	"testing"
+)
+
+// the state h starts at zero and accumulates the inputs of the steps
+const accumulatorInitNet = `
+name: "accumulator_init"
+op {
+  output: "h"
+  type: "ConstantFill"
+  arg { name: "shape" ints: 1 ints: 1 ints: 2 ints: 2 }
+  arg { name: "value" f: 0 }
+}
+`
+
+const accumulatorPredictNet = `
+name: "accumulator"
+external_input: "data"
+external_input: "h"
+external_output: "h_next"
+op { input: "data" input: "h" output: "h_next" type: "Add" }
+`
+
+func TestConcurrentSessions(t *testing.T) {
+	pred := newTestPredictor(t, accumulatorInitNet, accumulatorPredictNet, PredictorOptions{})
+	defer pred.Close()
+
+	const steps = 100
+	values := []float32{1, -2, 3, 0.5}
+	errs := make(chan error, len(values))
+	var wg sync.WaitGroup
+	for _, value := range values {
+		session, err := pred.NewSession(map[string]string{"h": "h_next"}, 0)
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer session.Close()
+
+		wg.Add(1)
+		go func(session *Session, value float32) {
+			defer wg.Done()
+			ctx := context.Background()
+			input := []float32{value, value, value, value}
+			for step := 1; step <= steps; step++ {
+				if err := session.Predict(ctx, input, 1, 2, 2); err != nil {
+					errs <- err
+					return
+				}
+				output, err := session.ReadPredictionOutput(ctx)
+				if err != nil {
+					errs <- err
+					return
+				}
+				if len(output) != len(input) {
+					t.Errorf("the session returned %d values, want %d", len(output), len(input))
+					return
+				}
+				want := value * float32(step)
+				for _, v := range output {
+					if v != want {
+						t.Errorf("step %d of the session fed %v returned %v, want %v", step, value, output, want)
+						return
+					}
+				}
+			}
+		}(session, value)
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		t.Fatal(err)
+	}
+}